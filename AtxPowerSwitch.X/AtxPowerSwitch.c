@@ -24,168 +24,2212 @@
  * 2                ATX power switch    The other wire from your power switch
  * 3                ATX power switch    One of the wires from your power switch
  * 5                16 (green)          ATX power-on
+ * 6                8 (gray)            ATX power good (only with USE_PWR_OK)
+ * 6                Reset header        Double-press output (USE_DOUBLE_PRESS)
+ * 7                LED anode           Status LED via ~1k (USE_STATUS_LED)
+ * 6, 7             * (any black)       Hold time jumpers (USE_HOLD_JUMPERS)
+ * 7                4 (red) via ref     +5VSB check reference (USE_VSB_MONITOR)
+ * 7                Host                Shutdown request (USE_SOFT_OFF)
+ * 6                Host                Shutdown acknowledge (USE_SOFT_OFF)
+ * 6                2nd power switch    Second switch (USE_DUAL_CHANNEL)
+ * 7                2nd PSU 16 (green)  Second power-on (USE_DUAL_CHANNEL)
+ * 7                Serial adapter RX   Event log readout (USE_EVENT_LOG)
+ * 7                Serial adapter RX   Debug output (USE_SERIAL_DEBUG)
  * 8                * (any black)       Ground
  * 
  * AtxPowerSwitch is in low-power sleep mode almost all the time, so it uses
- * very little power.
+ * very little power. Estimated (not measured) standby current at 5 V, from the
+ * host harness's wake rates in test/results.csv, its estimate of the awake
+ * cycles, and the datasheet's typical figures (WDT ~9 uA, BOR ~58 uA, ~0.5 mA
+ * awake):
+ * 
+ * Sleep mode               Wakes/s   Wake current   With WDT + BOR   Per day
+ * WDT polling (1:2)        27.8      ~0.28 uA       ~67.3 uA         ~1.61 mAh
+ * Adaptive WDT, on (1:4)   13.9      ~0.14 uA       ~67.1 uA         ~1.61 mAh
+ * IOC wake (1:128)         0.43      ~0.004 uA      ~67.0 uA         ~1.61 mAh
+ * 
+ * The brown-out reset dominates; the wake rate barely matters next to it. Set
+ * USE_AWAKE_PIN to measure a board: GP0 (pin 7) is high while awake.
+ * 
+ * The PIC12F1840 has the same pinout and can be used instead, with the
+ * PIC12F1840 project configuration. Its brown-out reset is off during sleep,
+ * so it draws far less in standby, but USE_PWR_OK, USE_TIMER1_HOLD,
+ * USE_WDT_CALIBRATION, USE_VSB_MONITOR and USE_ASM_IDLE are only supported on
+ * the PIC12F675.
  * 
  * Copyright 2025, Timothy Alicie
  *
  * ===========================================================================*/
 
+//=============================================================================
+// Includes
+//=============================================================================
+#include <xc.h>
+
+//=============================================================================
+// User-Setting Defines
+//=============================================================================
+
+// How long, in milliseconds, the power button must be held before powering off.
+#define POWER_OFF_TIME_MS   (500)
+
+// How long, in milliseconds, the power button must be held to force the supply
+// off from any state, as on an ATX board, or 0 to disable it. It must be longer
+// than POWER_OFF_TIME_MS, and a forced off can't be cancelled by releasing
+// early. Holds are counted in 8 bits, so this can be up to ~9 s.
+#define FORCE_OFF_TIME_MS   (0)
+
+// Set to 1 to pick the power off hold time at startup from jumpers on GP0 (pin
+// 7) and GP1 (pin 6) to ground, so it can be changed without reflashing. With
+// no jumpers it is POWER_OFF_TIME_MS. The pins are read once with their
+// pull-ups on, then driven low, so they draw no current afterwards. Each time
+// must be too long to be a bounce, and shorter than FORCE_OFF_TIME_MS.
+#define USE_HOLD_JUMPERS    (0)
+#define HOLD_TIME_GP0_MS    (250)   // Jumper on GP0 only.
+#define HOLD_TIME_GP1_MS    (1000)  // Jumper on GP1 only.
+#define HOLD_TIME_BOTH_MS   (2000)  // Jumpers on both.
+
+// What to do when +5VSB comes up, for example after an AC power loss: keep the
+// supply off (BOOT_OFF), power it on (BOOT_ON), or restore the state it was in
+// when power was lost (BOOT_RESTORE). BOOT_RESTORE saves the power state to the
+// data EEPROM on every change, spread over STATE_RING_SLOTS bytes for wear.
+#define BOOT_OFF            (0)
+#define BOOT_ON             (1)
+#define BOOT_RESTORE        (2)
+#define BOOT_POLICY         (BOOT_OFF)
+
+// When several supplies share a feed, give each unit its own slot number so
+// that they don't all power on at once when power comes back. The boot policy
+// (or resume after a brown-out) waits POWER_ON_SLOT * POWER_ON_SLOT_MS asleep
+// before asserting PS_ON, up to ~9 s in all. A press ends the wait early, and
+// is taken as the press that powered on, so holding it doesn't power off.
+#define POWER_ON_SLOT       (0)
+#define POWER_ON_SLOT_MS    (1000)
+
+// Set to 1 to turn off the 72 ms power-up timer. The brown-out reset still
+// holds the PIC in reset until Vdd is above VBOR. From +5VSB valid to the first
+// switch sample takes the power-up timer (72 ms nominal, 132 ms worst case)
+// plus under 1 ms of startup code and init (including the BOOT_RESTORE EEPROM
+// scan), or just the latter with this set. USE_SERIAL_DEBUG adds its R line
+// at startup, ~21 ms at 2400 baud.
+#define USE_FAST_BOOT       (0)
+
+// Set to 1 to wake on an interrupt-on-change of the switch input (GP4) while
+// the button is released, sleeping with a long watchdog interval in between.
+// Set to 0 to poll the switch on every watchdog timeout instead.
+#define USE_IOC_WAKE        (1)
+
+// Set to 1 to sleep with a longer watchdog interval while the supply is on and
+// the button is released, switching to the short tick only to time a press.
+// This is for boards without IOC wake (USE_IOC_WAKE 0), where the longer
+// interval can't be used while off without delaying power-on. A press to power
+// off may then be seen up to one idle interval late, so the interval is kept to
+// two ticks (~72 ms), which halves the wakes while on and still catches a hold
+// of the power off time to within a tick.
+#define USE_ADAPTIVE_WDT    (1)
+
+// Set to 1 to drive GP0 (pin 7) high for the whole awake window of each wake,
+// so that awake time and wake rate can be measured with a scope or logic
+// analyzer. Leave at 0 for normal use.
+#define USE_AWAKE_PIN       (0)
+
+// Set to 1 to watch ATX PWR_OK (pin 8, gray) on GP1 (pin 6) with the comparator
+// while the supply is on. Once PWR_OK has come up, a drop wakes the PIC at once
+// and releases PS_ON. The comparator and its reference are only powered while
+// the supply is on, so standby current is unchanged.
+#define USE_PWR_OK          (0)
+
+// Set to 1 to check +5VSB with the ADC while the supply is on, and release PS_ON
+// if it sags below VSB_LOW_MV, before the brown-out reset (~2.1 V) can leave
+// the supply half on. +5VSB is also the ADC reference, so it is measured by
+// reading a fixed VSB_REF_MV reference on AN0 (GP0, pin 7), such as an LM4040
+// fed through a resistor from the ATX +5 V rail (pin 4, red), which is only up
+// while the supply is on. The ADC is only powered for each conversion.
+#define USE_VSB_MONITOR     (0)
+#define VSB_REF_MV          (2500)
+#define VSB_LOW_MV          (4400)
+
+// The number of wakes between +5VSB samples with USE_VSB_MONITOR, while the
+// supply is on. 1 samples on every wake, which is every ~2.3 s with IOC wake
+// while the button is released. Raise it without IOC wake.
+#define VSB_SAMPLE_WAKES    (1)
+
+// Set to 1 to drive a status LED from GP0 (pin 7), through a resistor (1k gives
+// ~3 mA) to ground. It is off while the supply is off, on while it is on, and
+// blinks while the button is held to power off. It only changes on wakes that
+// happen anyway, so it adds no wakes, and it adds no current while off. While
+// on, it adds the LED current (~3 mA with 1k), or about half that blinking.
+#define USE_STATUS_LED      (0)
+
+// Set to 1 to ask the host to shut down, rather than cutting the power, once
+// the button has been held to power off. GP0 (pin 7) is driven high as a
+// "shutdown requested" line, and the supply stays on until the host pulls GP1
+// (pin 6, pulled up) low to acknowledge it, or SOFT_OFF_TIMEOUT_MS runs out.
+// The wait is spent asleep, with the idle interval, so it needs USE_IOC_WAKE for
+// timeouts over ~9 s, or ~18 s with USE_ADAPTIVE_WDT. FORCE_OFF_TIME_MS still cuts the
+// power at once.
+#define USE_SOFT_OFF        (0)
+#define SOFT_OFF_TIMEOUT_MS (60000)
+
+// Set to 1 to pull GP1 (pin 6) low for as long as a second press is held, if it
+// starts within DOUBLE_PRESS_TIME_MS of a release while the supply is on. This
+// can drive the motherboard's reset header in place of a reset button. GP1 is
+// otherwise left as an input, so the board's pull-up keeps it high. Needs
+// USE_IOC_WAKE, and can't be used with USE_PWR_OK.
+#define USE_DOUBLE_PRESS    (0)
+
+// How long, in milliseconds, after a release a press still counts as the second
+// press of a double press. The window is the first sleep after the release, so
+// this is rounded up to a watchdog interval (18 ms times a power of two). The
+// window adds one wake after each release, if no press ends it first.
+#define DOUBLE_PRESS_TIME_MS (250)
+
+// How long, in milliseconds, the switch input must settle before a press or a
+// release is accepted, or 0 to act on every sample. See DEBOUNCE_TICKS.
+#define DEBOUNCE_TIME_MS    (36)
+
+// Set to 1 to time the ticks while the button is held with Timer1, clocked from
+// the factory-calibrated 4 MHz internal oscillator, instead of the watchdog.
+// The WDT period varies widely with voltage and temperature, so this makes the
+// hold time as accurate as the oscillator (1-2%). Timer1 stops in sleep when
+// clocked from the instruction clock, so the core stays awake (~0.5 mA) while
+// the button is held. This loads OSCCAL from the RETLW at 0x3FF, which must not
+// have been erased.
+#define USE_TIMER1_HOLD     (0)
+
+// Set to 1 to measure the watchdog tick at startup with Timer1, clocked from
+// the factory-calibrated 4 MHz internal oscillator, and scale the power off
+// hold count to it. The hold time is then about as accurate as with
+// USE_TIMER1_HOLD, but the core still sleeps while the button is held. Timer1
+// keeps counting through a watchdog reset, so the tick is measured by letting
+// the watchdog reset the PIC once, which delays startup by one tick (~36 ms)
+// after a power-on reset. Set CALIBRATE_PERIOD_S to measure it again that
+// often while the supply is off, to follow drift with temperature, or 0 to
+// measure it only at power-on. It is never measured while the supply is on, as
+// the reset would release PS_ON. This also needs the OSCCAL RETLW at 0x3FF.
+#define USE_WDT_CALIBRATION (0)
+#define CALIBRATE_PERIOD_S  (0)
+
+// Set to 1 to control a second supply from a second switch, on GP1 (pin 6) and
+// GP5 (pin 2, shared with the first switch), with its PS_ON on GP0 (pin 7).
+// Each has its own copy of the state machine, with the same press and hold
+// timing, and both are handled on the same wakes. The other options apply to
+// the first channel only, and those using GP0 or GP1 can't be used. The second
+// channel starts off unless BOOT_POLICY is BOOT_ON, and resumes after a
+// brown-out or watchdog reset like the first. Needs USE_IOC_WAKE, and can't be
+// used with USE_INTEGRITY_CHECK, which doesn't check the second channel.
+#define USE_DUAL_CHANNEL    (0)
+
+// Set to 1 to run the idle wakes in a hand-written assembly loop (CLRWDT, test
+// GP4, SLEEP), leaving C to handle only the wakes that find the switch pressed.
+// The C loop is the reference, and both give the same PS_ON timeline on every
+// trace of the host harness, with a shorter awake window. Can't be used with USE_PWR_OK or
+// USE_DOUBLE_PRESS, which have their own work to do on idle wakes.
+#define USE_ASM_IDLE        (0)
+
+// Set to 1 to drive PS_ON (GP2) to match the remembered power state on every
+// wake, so that an ESD hit on the pin is put right on the next wake rather than
+// the next press, and to check the state every INTEGRITY_WAKES wakes. The check
+// sets the switch ground (GP5) and pull-up (GP4) again, and the OPTION_REG bits
+// other than the pre-scaler. The power state is kept with its complement, like
+// the remembered power state; if either fails its check, the other is trusted,
+// or the PS_ON pin itself if both fail, and the outputs are driven as on a
+// change of state. The hold time from USE_HOLD_JUMPERS or USE_WDT_CALIBRATION
+// is kept with its complement too, and goes back to the default if it fails.
+// Can't be used with USE_ASM_IDLE, whose wakes don't run it, or
+// USE_DUAL_CHANNEL.
+#define USE_INTEGRITY_CHECK (0)
+
+// The number of wakes between checks with USE_INTEGRITY_CHECK. 1 checks on
+// every wake, at about twice the cost of an idle wake; 8 checks every ~18 s
+// with IOC wake while the button is released.
+#define INTEGRITY_WAKES     (8)
+
+// Set to 1 to keep a log of power on and off, forced off, fault and reset
+// events in the data EEPROM, for diagnosing a unit from the field. Events are
+// only written when they happen, never on idle wakes, spread over
+// EVENT_LOG_SLOTS bytes for wear. Holding the switch while +5VSB comes up
+// sends the log, oldest first, as a line of text on GP0 (pin 7) at SERIAL_BAUD
+// (8N1, idle high), and again about every 2 s until the switch is released;
+// the supply stays off until then. GP0 can still be the awake pin or status
+// LED, which just flicker during the readout, but not the other GP0 options.
+#define USE_EVENT_LOG       (0)
+
+// Set to 1 to send a line of text on GP0 (pin 7) at SERIAL_BAUD (8N1, idle
+// high) for each state change, with the state (S), the hold count in ticks when
+// a hold powers off, forces off, or ends in a soft off (H), and the reset cause
+// at startup (R), each followed by two hex digits. This is for bench rigs, to
+// line up the button timing with the supply without a debugger. Nothing is sent
+// on idle wakes, but each line keeps the core awake for 5 bytes (~21 ms at
+// 2400, ~5 ms at 9600), stretching the tick it is sent in. GP0 is then used
+// only for this.
+#define USE_SERIAL_DEBUG    (0)
+
+// Set to 1 to count, in RAM, all wakes, wakes with the switch pressed, presses
+// rejected by the debounce, and wakes by the watchdog and by IOC, to check the
+// real wake rate on a board. The counts are 16 bits and stop at 0xFFFF rather
+// than wrapping, which takes ~39 minutes of polling or ~42 hours of IOC wake
+// idle. They start from zero at power-on and carry on over brown-out and
+// watchdog resets. With USE_SERIAL_DEBUG they are sent each time the supply
+// powers off, as a P line (see SendProfile); otherwise read them with a
+// debugger. Counting adds a few instructions to every wake. Can't be used with
+// USE_ASM_IDLE, whose wakes aren't counted.
+#define USE_WAKE_PROFILE    (0)
+
+// The rate of the serial output for USE_EVENT_LOG and USE_SERIAL_DEBUG.
+#define SERIAL_BAUD         (2400)
+
+//=============================================================================
 // Device Configuration
+//=============================================================================
+#if defined(_12F675)
 #pragma config FOSC   = INTRCIO  // Use the internal oscillator with IO on GP4
 #pragma config WDTE   = ON       // Enable the watchdog timer (used for sleep)
+#if USE_FAST_BOOT
+#pragma config PWRTE  = OFF      // No power on timer, for the fastest boot
+#else
 #pragma config PWRTE  = ON       // Enable 72 ms power on timer (power-up only)
+#endif
 #pragma config MCLRE  = OFF      // MCLR pin tied internally to Vdd
 #pragma config BOREN  = ON       // Brown-out reset enable
 #pragma config CP     = OFF      // Disable code protection
 #pragma config CPD    = OFF      // Disable data memory code protection
+#elif defined(_12F1840)
+#pragma config FOSC   = INTOSC   // Use the internal oscillator with IO on RA4
+#pragma config WDTE   = ON       // Enable the watchdog timer (used for sleep)
+#if USE_FAST_BOOT
+#pragma config PWRTE  = OFF      // No power on timer, for the fastest boot
+#else
+#pragma config PWRTE  = ON       // Enable 64 ms power on timer (power-up only)
+#endif
+#pragma config MCLRE  = OFF      // MCLR pin is a digital input (unused)
+#pragma config BOREN  = NSLEEP   // Brown-out reset while awake, off in sleep
+#pragma config BORV   = HI       // Brown-out reset at the high trip point
+#pragma config CP     = OFF      // Disable code protection
+#pragma config CPD    = OFF      // Disable data memory code protection
+#pragma config CLKOUTEN = OFF    // RA4 is IO, not CLKOUT
+#pragma config IESO   = OFF      // No two-speed startup
+#pragma config FCMEN  = OFF      // No fail-safe clock monitor
+#pragma config WRT    = OFF      // No flash write protection
+#pragma config PLLEN  = OFF      // No 4x PLL
+#pragma config STVREN = ON       // Reset on a stack overflow or underflow
+#pragma config LVP    = OFF      // No low-voltage programming
+#endif
 
 //=============================================================================
-// Includes
+// Hardware Abstraction
 //=============================================================================
-#include <xc.h>
 
-//=============================================================================
-// User-Setting Defines
-//=============================================================================
+// The registers that differ between the supported devices, so that the rest of
+// the firmware is the same on each. Pins are named by number n, as GPn on the
+// PIC12F675 and RAn on the PIC12F1840, which have the same pinout. These are
+// all macros, so they cost nothing at run time. Porting to another device means
+// adding a section here and under Device Configuration, and a configuration to
+// the MPLAB X project.
+#if defined(_12F675)
 
-// How long, in milliseconds, the power button must be held before powering off.
-#define POWER_OFF_TIME_MS   (500)
+#define PIN_IN(n)           GPIObits.GPIO##n        // Reads pin n.
+#define PIN_OUT(n)          GPIObits.GPIO##n        // Pin n's output latch.
+#define PIN_TRIS(n)         TRISIO##n               // 1 makes pin n an input.
+#define PIN_WPU(n)          WPUbits.WPU##n          // Pin n's weak pull-up.
+#define PIN_IOC(n, on)      IOCbits.IOC##n = (on);  // Wake on pin n changing.
+#define PORT_IN             GPIO                    // Reads all the pins.
+#define PORT_OUT            GPIO                    // All the output latches.
+
+// Enables the IOC wake, and clears its flag. GPIF is set by a mismatch with the
+// last read of GPIO, so it is cleared after sampling the pins, before SLEEP.
+#define IOC_ENABLE          INTCONbits.GPIE
+#define IOC_CLEAR_ON_WAKE
+#define IOC_CLEAR_TO_SLEEP  INTCONbits.GPIF = 0;
+
+// The nominal WDT timeout without the pre-scaler, in milliseconds, and the
+// largest pre-scaler selection (PS2:PS0 in OPTION_REG, 1:128). The OPTION_REG
+// bits are: GPIO pull-ups enabled by the WPU latches (bit 7), the GP2/INT edge,
+// Timer0 clock source and Timer0 edge (bits 6-4, we don't care), and the
+// pre-scaler assigned to the WDT (bit 3).
+#define WDT_BASE_MS         (18)
+#define WDT_PS_MAX          (7)
+#define OPTION_BASE         (0b00001000)
+#define WDT_INIT(ps)        OPTION_REG = OPTION_BASE | (ps);
+#define WDT_SET_PS(ps)      OPTION_REG = OPTION_BASE | (ps);
+
+// Sets the OPTION_REG bits again, keeping the pre-scaler selection.
+#define OPTION_REFRESH      OPTION_REG = (OPTION_REG & 0x07) | OPTION_BASE;
+
+// Turns off the analog inputs and the comparator, for the lowest power.
+#define ANALOG_OFF          ANSEL = 0;
+#define COMPARATOR_OFF      CMCON = 0x07;
+
+// Whether the last reset was a brown-out, and sets the reset flags again.
+#define RESET_WAS_BOR       (!PCONbits.nBOD)
+#define RESET_FLAGS_SET     PCON = 0b00000011;
+
+// Sets up the clock. The internal oscillator runs at 4 MHz from reset.
+#define CLOCK_INIT
+
+// Trims the internal oscillator with the factory value from the RETLW at 0x3FF,
+// for when the instruction timing matters.
+#define OSC_TRIM            OSCCAL = __osccal_val();
+
+#elif defined(_12F1840)
+
+#define PIN_IN(n)           PORTAbits.RA##n
+#define PIN_OUT(n)          LATAbits.LATA##n
+#define PIN_TRIS(n)         TRISAbits.TRISA##n
+#define PIN_WPU(n)          WPUAbits.WPUA##n
+#define PIN_IOC(n, on)      IOCAPbits.IOCAP##n = (on); IOCANbits.IOCAN##n = (on);
+#define PORT_IN             PORTA
+#define PORT_OUT            LATA
+
+// IOCAF latches each edge until cleared, rather than comparing with the last
+// read, so it is cleared at the top of the wake, before sampling the pins. An
+// edge after that sets it again, and SLEEP then returns at once.
+#define IOC_ENABLE          INTCONbits.IOCIE
+#define IOC_CLEAR_ON_WAKE   IOCAF = 0;
+#define IOC_CLEAR_TO_SLEEP
+
+// The WDT times 1 ms at 1:32 (WDTPS = 0) up to 256 s (WDTPS = 18), set in
+// WDTCON. OPTION_REG enables the weak pull-ups (nWPUEN, bit 7 clear), which
+// are off from reset.
+#define WDT_BASE_MS         (1)
+#define WDT_PS_MAX          (18)
+#define WDT_INIT(ps)        OPTION_REG = 0b01111111; WDTCON = (ps) << 1;
+#define WDT_SET_PS(ps)      WDTCON = (ps) << 1;
+#define OPTION_REFRESH      OPTION_REG = 0b01111111;
+
+#define ANALOG_OFF          ANSELA = 0;
+#define COMPARATOR_OFF      CM1CON0 = 0;
+
+#define RESET_WAS_BOR       (!PCONbits.nBOR)
+#define RESET_FLAGS_SET     PCON = 0b00001111;
+
+// The internal oscillator runs at 500 kHz from reset, so select 4 MHz to keep
+// the same instruction timing.
+#define CLOCK_INIT          OSCCON = 0b01101010;
+
+// The oscillator is trimmed from reset.
+#define OSC_TRIM
+
+#else
+#error "Unsupported device: add it under Device Configuration and Hardware Abstraction"
+#endif
 
 //=============================================================================
-// Utility Defines
+// Timing Defines
 //=============================================================================
 
-// The nominal watchdog timeout value, including 2x pre-scaler, in milliseconds.
-#define WDT_MS              (18*2)
+// Every user setting in milliseconds is converted to ticks (wake cycles) here,
+// at compile time. A setting that rounds to zero ticks or doesn't fit in
+// ticks_t fails the build, so the firmware does what the numbers say.
+
+// The WDT pre-scaler selection used to time the button. The watchdog timeout
+// (WDT_BASE_MS) is multiplied by 2^TICK_PS, so on the PIC12F675 1 selects 1:2
+// (36 ms). The PIC12F1840 uses 5 (32 ms).
+#if defined(_12F1840)
+#define TICK_PS             (5)
+#else
+#define TICK_PS             (1)
+#endif
+
+// The WDT pre-scaler selection used while idle. With IOC wake, 7 selects 1:128,
+// so we wake only about every 2.3 seconds; a switch press wakes us at once.
+// Without it, 2 selects 1:4 (72 ms, two ticks), which bounds how late a power
+// off press is seen to one tick more than polling (see USE_ADAPTIVE_WDT). The
+// PIC12F1840 uses 11 (~2 s) and 6 (64 ms).
+#if defined(_12F1840)
+#define IDLE_PS             ((USE_IOC_WAKE) ? 11 : 6)
+#else
+#define IDLE_PS             ((USE_IOC_WAKE) ? 7 : 2)
+#endif
+
+// The nominal watchdog timeout value, including pre-scaler, in milliseconds.
+// This is the length of one tick.
+#define WDT_MS              (WDT_BASE_MS << TICK_PS)
 
 // The approximate number of times per second we wake and process data.
 #define TICK_RATE_HZ        (1000 / WDT_MS)
 
+// Converts a time in milliseconds to the nearest whole number of ticks.
+#define MS_TO_TICKS(ms)     (((ms) + (WDT_MS / 2)) / WDT_MS)
+
+// The type used to count ticks, and the largest count it can hold. 8 bits keeps
+// the per-wake counting to a few instructions on the PIC's 8-bit core.
+typedef unsigned char       ticks_t;
+#define TICKS_MAX           (0xFF)
+
 // The number of ticks (wake cycles) before powering off.
-#define POWER_OFF_COUNT     (POWER_OFF_TIME_MS / TICK_RATE_HZ)
+#define POWER_OFF_COUNT     MS_TO_TICKS(POWER_OFF_TIME_MS)
+
+// The number of ticks before powering off for each hold time jumper setting,
+// when USE_HOLD_JUMPERS is set.
+#define HOLD_GP0_COUNT      MS_TO_TICKS(HOLD_TIME_GP0_MS)
+#define HOLD_GP1_COUNT      MS_TO_TICKS(HOLD_TIME_GP1_MS)
+#define HOLD_BOTH_COUNT     MS_TO_TICKS(HOLD_TIME_BOTH_MS)
+
+// The number of ticks to wait before powering on at startup.
+#define POWER_ON_DELAY_TICKS MS_TO_TICKS(POWER_ON_SLOT * (long)POWER_ON_SLOT_MS)
+
+// The ADC result (top 8 bits) above which +5VSB is below VSB_LOW_MV. A falling
+// +5VSB reads the fixed reference as a larger fraction of it.
+#define VSB_LOW_CODE        ((256L * VSB_REF_MV) / VSB_LOW_MV)
+
+// The interval of the wakes while waiting for the host with USE_SOFT_OFF, and
+// the number of them before giving up. The button is released, so the wait
+// uses the idle interval if there is one.
+#if USE_IOC_WAKE || USE_ADAPTIVE_WDT
+#define SOFT_OFF_WAKE_MS    (WDT_BASE_MS << IDLE_PS)
+#else
+#define SOFT_OFF_WAKE_MS    WDT_MS
+#endif
+#define SOFT_OFF_WAKES      ((SOFT_OFF_TIMEOUT_MS + (SOFT_OFF_WAKE_MS / 2)) / \
+                             SOFT_OFF_WAKE_MS)
+
+// The number of ticks before forcing the supply off.
+#define FORCE_OFF_COUNT     MS_TO_TICKS(FORCE_OFF_TIME_MS)
+
+// Timer1 settings for measuring the watchdog tick with USE_WDT_CALIBRATION:
+// counting the instruction clock at 1:8 (8 us per count), and the count one
+// tick should be. Measurements outside a quarter to four times the nominal
+// count are ignored, as the WDT varies less than that.
+#define CAL_T1CON           (0b00110001)
+#define CAL_NOMINAL         ((WDT_MS * 1000U) >> 3)
+#define CAL_MIN             (CAL_NOMINAL / 4)
+#define CAL_MAX             (CAL_NOMINAL * 4)
+
+// The interval of the wakes while the supply is off, and the number of them
+// between measurements, for CALIBRATE_PERIOD_S.
+#if USE_IOC_WAKE
+#define CAL_WAKE_MS         (WDT_BASE_MS << IDLE_PS)
+#else
+#define CAL_WAKE_MS         WDT_MS
+#endif
+#define CAL_WAKES           ((CALIBRATE_PERIOD_S * 1000UL + (CAL_WAKE_MS / 2)) / \
+                             CAL_WAKE_MS)
+
+// The number of ticks the debouncer adds. Samples are integrated up and down
+// between 0 and DEBOUNCE_MAX, and the button state only changes at either end.
+// Once the input settles, the change is seen at most DEBOUNCE_TICKS ticks later
+// than without debouncing, however the input bounced before that.
+#define DEBOUNCE_TICKS      MS_TO_TICKS(DEBOUNCE_TIME_MS)
+#define DEBOUNCE_MAX        (DEBOUNCE_TICKS + 1)
+
+// The pre-scaler selection of the shortest watchdog interval at least ms long,
+// up to 2^12 times WDT_BASE_MS.
+#define MS_TO_PS(ms)        (((ms) <= (WDT_BASE_MS << 0)) ? 0 : \
+                             ((ms) <= (WDT_BASE_MS << 1)) ? 1 : \
+                             ((ms) <= (WDT_BASE_MS << 2)) ? 2 : \
+                             ((ms) <= (WDT_BASE_MS << 3)) ? 3 : \
+                             ((ms) <= (WDT_BASE_MS << 4)) ? 4 : \
+                             ((ms) <= (WDT_BASE_MS << 5)) ? 5 : \
+                             ((ms) <= (WDT_BASE_MS << 6)) ? 6 : \
+                             ((ms) <= (WDT_BASE_MS << 7)) ? 7 : \
+                             ((ms) <= (WDT_BASE_MS << 8)) ? 8 : \
+                             ((ms) <= (WDT_BASE_MS << 9)) ? 9 : \
+                             ((ms) <= (WDT_BASE_MS << 10)) ? 10 : \
+                             ((ms) <= (WDT_BASE_MS << 11)) ? 11 : 12)
+
+// The pre-scaler for the double-press window.
+#define DOUBLE_PS           MS_TO_PS(DOUBLE_PRESS_TIME_MS)
+
+// Fails the build if the constant expression expr is false.
+#define STATIC_ASSERT(name, expr) \
+    typedef char static_assert_##name[(expr) ? 1 : -1]
+
+// Fails the build if a tick count rounds to zero or overflows ticks_t.
+#define CHECK_TICKS(name) \
+    typedef char check_ticks_##name[(((name) > 0) && ((name) <= TICKS_MAX)) ? 1 : -1]
+
+// The Timer1 pre-scaler selection (T1CKPS) and preload that make one Timer1
+// overflow last one tick, counting 1 us instruction cycles at 4 MHz.
+#define TMR1_PS             ((WDT_MS <= 65) ? 0 : (WDT_MS <= 131) ? 1 : \
+                             (WDT_MS <= 262) ? 2 : 3)
+#define TMR1_PRELOAD        (0x10000 - ((WDT_MS * 1000UL) >> TMR1_PS))
+
+STATIC_ASSERT(TICK_PS, (TICK_PS >= 0) && (TICK_PS <= WDT_PS_MAX));
+STATIC_ASSERT(IDLE_PS, (IDLE_PS >= TICK_PS) && (IDLE_PS <= WDT_PS_MAX));
+#if USE_ADAPTIVE_WDT && !USE_IOC_WAKE
+// A hold is first seen up to one idle interval late, so a longer interval would
+// miss holds of the power off time.
+STATIC_ASSERT(ADAPTIVE_WDT, IDLE_PS <= TICK_PS + 1);
+#endif
+#if defined(_12F1840)
+// These use PIC12F675 registers directly.
+STATIC_ASSERT(DEVICE_OPTIONS, !USE_PWR_OK && !USE_VSB_MONITOR &&
+              !USE_TIMER1_HOLD && !USE_ASM_IDLE && !USE_WDT_CALIBRATION);
+#endif
+CHECK_TICKS(POWER_OFF_COUNT);
+#if USE_HOLD_JUMPERS
+CHECK_TICKS(HOLD_GP0_COUNT);
+CHECK_TICKS(HOLD_GP1_COUNT);
+CHECK_TICKS(HOLD_BOTH_COUNT);
+#endif
+#if USE_TIMER1_HOLD
+STATIC_ASSERT(TMR1_PRELOAD, TMR1_PRELOAD < 0x10000);
+#endif
+#if POWER_ON_SLOT
+CHECK_TICKS(POWER_ON_DELAY_TICKS);
+#endif
+#if FORCE_OFF_TIME_MS
+CHECK_TICKS(FORCE_OFF_COUNT);
+STATIC_ASSERT(FORCE_OFF_COUNT, FORCE_OFF_COUNT > POWER_OFF_COUNT);
+#if USE_HOLD_JUMPERS
+STATIC_ASSERT(FORCE_OFF_HOLD, (FORCE_OFF_COUNT > HOLD_GP0_COUNT) &&
+              (FORCE_OFF_COUNT > HOLD_GP1_COUNT) &&
+              (FORCE_OFF_COUNT > HOLD_BOTH_COUNT));
+#endif
+#endif
+#if USE_VSB_MONITOR
+STATIC_ASSERT(VSB_LOW_CODE, (VSB_LOW_CODE > 0) && (VSB_LOW_CODE < 255));
+STATIC_ASSERT(VSB_SAMPLE_WAKES, (VSB_SAMPLE_WAKES > 0) &&
+              (VSB_SAMPLE_WAKES <= 255));
+#endif
+#if USE_SOFT_OFF
+STATIC_ASSERT(SOFT_OFF_WAKES, (SOFT_OFF_WAKES > 0) && (SOFT_OFF_WAKES <= 255));
+#endif
+#if USE_WDT_CALIBRATION
+// Scaling the hold count adds up to CAL_MAX + CAL_NOMINAL in 16 bits, and a
+// measurement is told apart from zero by its high byte.
+STATIC_ASSERT(WDT_CALIBRATION, !USE_TIMER1_HOLD && (CAL_MIN >= 0x100) &&
+              (CAL_MAX + CAL_NOMINAL <= 0xFFFFUL));
+#if CALIBRATE_PERIOD_S
+STATIC_ASSERT(CAL_WAKES, (CAL_WAKES > 0) && (CAL_WAKES <= 0xFFFF));
+STATIC_ASSERT(CALIBRATE_PERIOD, !USE_ASM_IDLE && !USE_DUAL_CHANNEL);
+#endif
+#endif
+#if USE_DUAL_CHANNEL
+STATIC_ASSERT(DUAL_CHANNEL, USE_IOC_WAKE && !USE_ASM_IDLE);
+#endif
+#if USE_ASM_IDLE
+STATIC_ASSERT(ASM_IDLE, !USE_PWR_OK && !USE_DOUBLE_PRESS &&
+              !USE_VSB_MONITOR && !USE_SOFT_OFF);
+#endif
+#if USE_INTEGRITY_CHECK
+STATIC_ASSERT(INTEGRITY_CHECK, !USE_ASM_IDLE && !USE_DUAL_CHANNEL);
+STATIC_ASSERT(INTEGRITY_WAKES, (INTEGRITY_WAKES > 0) &&
+              (INTEGRITY_WAKES <= 255));
+#endif
+#if USE_WAKE_PROFILE
+STATIC_ASSERT(WAKE_PROFILE, !USE_ASM_IDLE);
+#endif
+#if USE_DOUBLE_PRESS
+STATIC_ASSERT(DOUBLE_PRESS, USE_IOC_WAKE && (DOUBLE_PS < IDLE_PS));
+#endif
+#if DEBOUNCE_TIME_MS
+CHECK_TICKS(DEBOUNCE_TICKS);
+STATIC_ASSERT(DEBOUNCE_TICKS, DEBOUNCE_TICKS < POWER_OFF_COUNT);
+#if USE_HOLD_JUMPERS
+STATIC_ASSERT(DEBOUNCE_HOLD, (DEBOUNCE_TICKS < HOLD_GP0_COUNT) &&
+              (DEBOUNCE_TICKS < HOLD_GP1_COUNT) &&
+              (DEBOUNCE_TICKS < HOLD_BOTH_COUNT));
+#endif
+#endif
+
+//=============================================================================
+// Utility Defines
+//=============================================================================
 
 // The input used for reading the ATX power switch. RA4 is the only unused input
 // with a built-in pull-up resistor, so use it.
-#define SWITCH_INPUT        GPIObits.GPIO4
+#define SWITCH_INPUT        PIN_IN(4)
+
+// Switches to the long sleep interval once there is nothing left to time, and
+// back to the short tick to time the button. The WDT is cleared at the top of
+// each wake, so the pre-scaler can be changed safely.
+#if USE_IOC_WAKE && USE_DUAL_CHANNEL
+// With two channels, only go idle once neither is timing its button.
+#define ENTER_IDLE          if (!TIMING_ANY) \
+                            { WDT_SET_PS(IDLE_PS); IOC_ENABLE = 1; }
+#define LEAVE_IDLE          WDT_SET_PS(TICK_PS); IOC_ENABLE = 0;
+#elif USE_IOC_WAKE
+// IOC wakes are turned off while timing so that bounces aren't counted as
+// extra ticks.
+#define ENTER_IDLE          WDT_SET_PS(IDLE_PS); IOC_ENABLE = 1;
+#define LEAVE_IDLE          WDT_SET_PS(TICK_PS); IOC_ENABLE = 0;
+#elif USE_ADAPTIVE_WDT
+// Without IOC wake, the long interval would delay power on, so only use it
+// while the supply is on. The power state only changes while the button is
+// held, so checking it when going idle is enough.
+#define ENTER_IDLE          if (POWERED_ON) { WDT_SET_PS(IDLE_PS); }
+#define LEAVE_IDLE          WDT_SET_PS(TICK_PS);
+#else
+#define ENTER_IDLE
+#define LEAVE_IDLE
+#endif
+
+// Whether the (debounced) button is released, and whether a press has been
+// accepted. BUTTON_PRESSED is only checked while not released, so without
+// debouncing it is always true.
+#if DEBOUNCE_TICKS
+#define BUTTON_RELEASED     (debounce == 0)
+#define BUTTON_PRESSED      (debounce == DEBOUNCE_MAX)
+#else
+#define BUTTON_RELEASED     (SWITCH_INPUT == 1)
+#define BUTTON_PRESSED      (1)
+#endif
+
+// Whether the button is being timed, as opposed to idle.
+#if DEBOUNCE_TICKS
+#define BUTTON_TIMING       (debounce != 0)
+#else
+#define BUTTON_TIMING       (lastButtonState)
+#endif
+
+// The same for the second channel, with USE_DUAL_CHANNEL.
+#define SWITCH2_INPUT       PIN_IN(1)
+#if DEBOUNCE_TICKS
+#define BUTTON2_RELEASED    (debounce2 == 0)
+#define BUTTON2_PRESSED     (debounce2 == DEBOUNCE_MAX)
+#define BUTTON2_TIMING      (debounce2 != 0)
+#else
+#define BUTTON2_RELEASED    (SWITCH2_INPUT == 1)
+#define BUTTON2_PRESSED     (1)
+#define BUTTON2_TIMING      (lastButtonState2)
+#endif
+
+// Whether any button is being timed.
+#if USE_DUAL_CHANNEL
+#define TIMING_ANY          (BUTTON_TIMING || BUTTON2_TIMING)
+#else
+#define TIMING_ANY          BUTTON_TIMING
+#endif
+
+// The output driven high while awake, when USE_AWAKE_PIN is set.
+#define AWAKE_PIN           PIN_OUT(0)
+
+// The status LED output, when USE_STATUS_LED is set, and the bit of the hold
+// count that blinks it (toggling every 4 ticks, ~3.5 Hz).
+#define STATUS_LED          PIN_OUT(0)
+#define LED_BLINK_BIT       (0x04)
+
+// The spare GPIO pins used by each option. They must not overlap, which is the
+// case when adding them gives the same result as OR-ing them.
+#define PINS_AWAKE          (USE_AWAKE_PIN ? 0x01 : 0)
+#define PINS_PWR_OK         (USE_PWR_OK ? 0x02 : 0)
+#define PINS_STATUS_LED     (USE_STATUS_LED ? 0x01 : 0)
+#define PINS_DOUBLE         (USE_DOUBLE_PRESS ? 0x02 : 0)
+#define PINS_HOLD_JUMPERS   (USE_HOLD_JUMPERS ? 0x03 : 0)
+#define PINS_VSB            (USE_VSB_MONITOR ? 0x01 : 0)
+#define PINS_SOFT_OFF       (USE_SOFT_OFF ? 0x03 : 0)
+#define PINS_DUAL           (USE_DUAL_CHANNEL ? 0x03 : 0)
+#define PINS_SERIAL         (USE_SERIAL_DEBUG ? 0x01 : 0)
+#define PINS_SUM            (PINS_AWAKE + PINS_PWR_OK + PINS_STATUS_LED + \
+                             PINS_DOUBLE + PINS_HOLD_JUMPERS + PINS_VSB + \
+                             PINS_SOFT_OFF + PINS_DUAL + PINS_SERIAL)
+#define PINS_ALL            (PINS_AWAKE | PINS_PWR_OK | PINS_STATUS_LED | \
+                             PINS_DOUBLE | PINS_HOLD_JUMPERS | PINS_VSB | \
+                             PINS_SOFT_OFF | PINS_DUAL | PINS_SERIAL)
+
+STATIC_ASSERT(PINS, PINS_SUM == PINS_ALL);
 
 // Powers off the ATX power supply by setting GP2 as an input.
-#define POWER_OFF           TRISIO2 = 1; poweredOn = 0;
+#define POWER_OFF           PIN_TRIS(2) = 1;
+
+// Powers on the ATX power supply by setting GP2 as an output, pulled low. The
+// GP2 latch is cleared first: while GP2 is an input, PS_ON reads high, and any
+// read-modify-write of GPIO (such as driving AWAKE_PIN) copies that into it.
+#define POWER_ON            PIN_OUT(2) = 0; PIN_TRIS(2) = 0;
+
+// Powers the second channel's supply off and on (GP0), in the same way as the
+// first, for USE_DUAL_CHANNEL.
+#define POWER2_OFF          PIN_TRIS(0) = 1;
+#define POWER2_ON           PIN_OUT(0) = 0; PIN_TRIS(0) = 0;
+
+// The "shutdown requested" output and the host's acknowledge input, active low,
+// for USE_SOFT_OFF.
+#define SHUTDOWN_REQ        PIN_OUT(0)
+#define HOST_ACK            PIN_IN(1)
+
+// Pulls the double-press output (GP1) low, or releases it, in the same way as
+// PS_ON, for USE_DOUBLE_PRESS.
+#define DOUBLE_OUT_ON       PIN_OUT(1) = 0; PIN_TRIS(1) = 0;
+#define DOUBLE_OUT_OFF      PIN_TRIS(1) = 1;
+
+// Comparator settings for watching PWR_OK. CMCON selects the comparator without
+// output, comparing CIN- (GP1) against the internal reference, with the output
+// inverted so that COUT is 1 while PWR_OK is high. VRCON enables the reference
+// in the low range at 8/24 Vdd (1.7 V at 5 V), between the TTL levels.
+#define PWR_OK_CMCON        (0b00010100)
+#define PWR_OK_VRCON        (0b10101000)
+
+// ADC settings for checking +5VSB. ANSEL makes AN0 analog, with the ADC clocked
+// at Fosc/8 (2 us at 4 MHz). ADCON0 selects AN0, left-justified against Vdd,
+// with the ADC on. The acquisition time is in instruction cycles (1 us), a
+// little over the datasheet's 20 us for a 10k source.
+#define VSB_ANSEL           (0b00010001)
+#define VSB_ADCON0          (0b00000001)
+#define VSB_ACQ_CYCLES      (22)
+
+// The data EEPROM ring used to save the power state for BOOT_RESTORE. Each
+// change is written to the next slot, so each cell sees 1/STATE_RING_SLOTS of
+// the writes. A slot holds STATE_SLOT_MARK, a phase bit that flips each time
+// the ring wraps around, and the power state in bit 0. The most recent slot is
+// the one before the first phase change or unwritten (0xFF) slot.
+#define STATE_RING_BASE     (0x00)
+#define STATE_RING_SLOTS    (32)
+#define STATE_SLOT_MARK     (0xA0)
+#define STATE_SLOT_MASK     (0xFC)
+#define STATE_SLOT_PHASE    (0x02)
+
+STATIC_ASSERT(STATE_RING, STATE_RING_BASE + STATE_RING_SLOTS <= 128);
+
+// The data EEPROM ring used for the event log, after the power state ring.
+// Each entry holds the event, one of LOG_*, in the low nibble and the number of
+// times the ring has wrapped around, modulo 16, in the high nibble. The next
+// entry goes in the first slot whose count differs from the first slot's, or
+// the first unwritten (0xFF) slot; LOG_* stops at 14, so no entry reads 0xFF.
+#define EVENT_LOG_BASE      (0x20)
+#define EVENT_LOG_SLOTS     (96)
+
+STATIC_ASSERT(EVENT_LOG, (STATE_RING_BASE + STATE_RING_SLOTS <= EVENT_LOG_BASE) &&
+              (EVENT_LOG_BASE + EVENT_LOG_SLOTS <= 128));
+#if USE_EVENT_LOG
+STATIC_ASSERT(EVENT_LOG_PINS, !USE_HOLD_JUMPERS && !USE_VSB_MONITOR &&
+              !USE_SOFT_OFF && !USE_DUAL_CHANNEL);
+#endif
 
-// Powers on the ATX power supply by setting GP2 as an output, pulled low.
-#define POWER_ON            TRISIO2 = 0; poweredOn = 1;
+// The events kept in the log. The resets are LOG_POR plus the RESET_* cause.
+#define LOG_POWER_ON        (0)     // The supply was powered on.
+#define LOG_POWER_OFF       (1)     // The supply was powered off by a hold.
+#define LOG_FORCE_OFF       (2)     // The supply was forced off.
+#define LOG_FAULT           (3)     // PWR_OK or +5VSB failed with the supply on.
+#define LOG_POR             (4)     // Power-on reset.
+#define LOG_BOR             (5)     // Brown-out reset.
+#define LOG_WDT             (6)     // Watchdog reset while awake.
+
+// The serial output used for the log readout, and the time of one bit in
+// instruction cycles (1 us) less the ~13 cycles the bit loop takes around its
+// delay.
+#define SERIAL_TX           PIN_OUT(0)
+#define SERIAL_BIT_DELAY    ((1000000UL / SERIAL_BAUD) - 13)
+
+#if USE_EVENT_LOG || USE_SERIAL_DEBUG
+STATIC_ASSERT(SERIAL_BAUD, (SERIAL_BAUD >= 300) && (SERIAL_BAUD <= 9600));
+#endif
+
+// The causes of a reset, from PCON.
+#define RESET_POR           (0)     // Power-on reset: +5VSB came up.
+#define RESET_BOR           (1)     // Brown-out reset: +5VSB sagged below VBOR.
+#define RESET_WDT           (2)     // The watchdog timed out while awake.
+#define RESET_CAL           (3)     // A CALIBRATE_PERIOD_S measurement ended.
+#define RESET_NONE          (0xFF)  // No watchdog tick being measured (calCause).
+
+// Remembers the power state in RAM that survives a brown-out or watchdog reset,
+// along with its complement to tell it from garbage after a power-on reset.
+#define REMEMBER_POWERED(p) lastPowered = (p); lastPoweredCheck = ~(p);
+
+// The same for the second channel, with USE_DUAL_CHANNEL.
+#define REMEMBER_POWERED2(p) lastPowered2 = (p); lastPowered2Check = ~(p);
+
+// The type of the USE_WAKE_PROFILE counts, the count they stop at, and counts
+// one, saturating.
+typedef unsigned int        profile_t;
+#define PROFILE_MAX         (0xFFFF)
+#define PROFILE_COUNT(c)    if ((c) != PROFILE_MAX) { (c)++; }
+
+// Keeps the complement of the power state, for USE_INTEGRITY_CHECK, each time
+// the state is set.
+#if USE_INTEGRITY_CHECK
+#define STATE_CHECK_UPDATE  powerStateCheck = ~powerState;
+#define STATE_CHECK_VALID   (powerStateCheck == (unsigned char)~powerState)
+#else
+#define STATE_CHECK_UPDATE
+#endif
+
+// The same for the hold time picked at startup, with USE_HOLD_JUMPERS or
+// USE_WDT_CALIBRATION.
+#if USE_INTEGRITY_CHECK && (USE_HOLD_JUMPERS || USE_WDT_CALIBRATION)
+#define HOLD_CHECK_UPDATE   powerOffCountCheck = ~powerOffCount;
+#define HOLD_CHECK_VALID    (powerOffCountCheck == (ticks_t)~powerOffCount)
+#else
+#define HOLD_CHECK_UPDATE
+#define HOLD_CHECK_VALID    (1)
+#endif
+#define REMEMBERED_VALID    (lastPoweredCheck == (unsigned char)~lastPowered)
+#define REMEMBERED2_VALID   (lastPowered2Check == (unsigned char)~lastPowered2)
+
+// Whether the measured watchdog tick in RAM is from before the last reset, in
+// the same way, for USE_WDT_CALIBRATION.
+#define CAL_VALID           (calPeriodCheck == (unsigned int)~calPeriod)
+
+// The number of ticks the button must be held before powering off.
+#if USE_HOLD_JUMPERS || USE_WDT_CALIBRATION
+#define HOLD_OFF_COUNT      powerOffCount
+#else
+#define HOLD_OFF_COUNT      POWER_OFF_COUNT
+#endif
+
+// Whether the ATX power supply is on in the current state.
+#define POWERED_ON          (statePowered[powerState])
+
+//=============================================================================
+// State Machine
+//=============================================================================
+
+// The power states.
+enum
+{
+    STATE_OFF,          // The supply is off.
+    STATE_ON,           // The supply is on.
+    STATE_ARMED,        // The supply is on and the button is held to power off.
+    STATE_DOUBLE,       // The supply is on and a double press is held.
+    STATE_SHUTDOWN,     // The supply is on until the host shuts down.
+    NUM_STATES
+};
+
+// The events that drive the state machine.
+enum
+{
+    EVENT_PRESS,        // The button has just been pressed.
+    EVENT_RELEASE,      // The button has just been released.
+    EVENT_HOLD,         // The button has been held for HOLD_OFF_COUNT ticks.
+    EVENT_FAULT,        // PWR_OK or +5VSB dropped while the supply was on.
+    EVENT_RESTORE,      // The boot policy powers the supply on at startup.
+    EVENT_DOUBLE,       // The button was pressed again soon after a release.
+    EVENT_FORCE_OFF,    // The button has been held for FORCE_OFF_COUNT ticks.
+    EVENT_ACK,          // The host has shut down, or the wait for it timed out.
+    NUM_EVENTS
+};
+
+// The state a completed hold to power off leads to.
+#if USE_SOFT_OFF
+#define STATE_SOFT_OFF      STATE_SHUTDOWN
+#else
+#define STATE_SOFT_OFF      STATE_OFF
+#endif
+
+// The next state for each state and event. New behavior should be added here
+// as new states and events, rather than as branches in main.
+const unsigned char stateTransitions[NUM_STATES][NUM_EVENTS] =
+{
+    //                     PRESS           RELEASE         HOLD            FAULT      RESTORE         DOUBLE          FORCE_OFF  ACK
+    /* STATE_OFF      */ { STATE_ON,       STATE_OFF,      STATE_OFF,      STATE_OFF, STATE_ON,       STATE_ON,       STATE_OFF, STATE_OFF },
+    /* STATE_ON       */ { STATE_ARMED,    STATE_ON,       STATE_ON,       STATE_OFF, STATE_ON,       STATE_DOUBLE,   STATE_OFF, STATE_ON },
+    /* STATE_ARMED    */ { STATE_ARMED,    STATE_ON,       STATE_SOFT_OFF, STATE_OFF, STATE_ARMED,    STATE_ARMED,    STATE_OFF, STATE_ARMED },
+    /* STATE_DOUBLE   */ { STATE_DOUBLE,   STATE_ON,       STATE_DOUBLE,   STATE_OFF, STATE_DOUBLE,   STATE_DOUBLE,   STATE_OFF, STATE_DOUBLE },
+    /* STATE_SHUTDOWN */ { STATE_SHUTDOWN, STATE_SHUTDOWN, STATE_SHUTDOWN, STATE_OFF, STATE_SHUTDOWN, STATE_SHUTDOWN, STATE_OFF, STATE_OFF },
+};
+
+// The status LED modes.
+enum
+{
+    LED_OFF,
+    LED_ON,
+    LED_BLINK
+};
+
+// The status LED mode in each state.
+const unsigned char stateLed[NUM_STATES] =
+{
+    LED_OFF,            // STATE_OFF
+    LED_ON,             // STATE_ON
+    LED_BLINK,          // STATE_ARMED
+    LED_ON,             // STATE_DOUBLE
+    LED_ON,             // STATE_SHUTDOWN
+};
+
+// Whether the supply is powered on (1) or off (0) in each state.
+const unsigned char statePowered[NUM_STATES] =
+{
+    0,                  // STATE_OFF
+    1,                  // STATE_ON
+    1,                  // STATE_ARMED
+    1,                  // STATE_DOUBLE
+    1,                  // STATE_SHUTDOWN
+};
+
+#if USE_HOLD_JUMPERS
+// The number of ticks before powering off for each reading of GP1:GP0, where a
+// fitted jumper reads 0.
+const ticks_t holdOffCounts[4] =
+{
+    HOLD_BOTH_COUNT,    // Jumpers on both.
+    HOLD_GP1_COUNT,     // Jumper on GP1 only.
+    HOLD_GP0_COUNT,     // Jumper on GP0 only.
+    POWER_OFF_COUNT,    // No jumpers.
+};
+#endif
 
 //=============================================================================
 // Variables
 //=============================================================================
 
-// Whether the ATX power supply is currently powered on (1) or off (0).
-unsigned char poweredOn;
+// The current power state.
+unsigned char powerState;
+
+#if USE_INTEGRITY_CHECK
+// The complement of the power state, to check it with.
+unsigned char powerStateCheck;
+
+// The number of wakes left until the next check.
+unsigned char integrityWakes;
+#endif
+
+// The cause of the last reset, one of RESET_*.
+unsigned char resetCause;
+
+// The power state as of the last change, kept over brown-out and watchdog
+// resets. The startup code doesn't clear persistent variables.
+persistent unsigned char lastPowered;
+persistent unsigned char lastPoweredCheck;
+
+#if USE_PWR_OK
+// Whether PWR_OK has come up since the supply was powered on. It only comes up
+// 100-500 ms after PS_ON, so a low PWR_OK is only a fault once it has.
+unsigned char pwrOkSeen;
+#endif
+
+#if USE_DUAL_CHANNEL
+// The second channel's power state, and as of its last change, kept over
+// brown-out and watchdog resets like lastPowered.
+unsigned char powerState2;
+persistent unsigned char lastPowered2;
+persistent unsigned char lastPowered2Check;
+#endif
+
+#if USE_SOFT_OFF
+// The number of idle wakes left to wait for the host to shut down.
+unsigned char shutdownWakes;
+#endif
+
+#if USE_VSB_MONITOR
+// The number of wakes left until the next +5VSB sample.
+unsigned char vsbWakes;
+#endif
+
+#if USE_HOLD_JUMPERS || USE_WDT_CALIBRATION
+// The number of ticks before powering off, picked by the jumpers at startup and
+// scaled to the measured watchdog tick.
+ticks_t powerOffCount;
+#if USE_INTEGRITY_CHECK
+// Its complement, to check it on each wake.
+ticks_t powerOffCountCheck;
+#endif
+#endif
+
+#if USE_WDT_CALIBRATION
+// The measured watchdog tick in Timer1 counts and its complement, kept over
+// brown-out and watchdog resets, and the cause of the reset before the running
+// measurement, or RESET_NONE.
+persistent unsigned int calPeriod;
+persistent unsigned int calPeriodCheck;
+persistent unsigned char calCause;
+#endif
+
+#if CALIBRATE_PERIOD_S
+// The number of wakes with the supply off left until the next measurement.
+unsigned int calWakes;
+#endif
+
+#if USE_WAKE_PROFILE
+// The wake counts, kept over brown-out and watchdog resets: all wakes, wakes
+// with the switch pressed, presses rejected by the debounce, and watchdog and
+// IOC wakes from sleep.
+persistent profile_t profileWakes;
+persistent profile_t profilePressed;
+persistent profile_t profileRejected;
+persistent profile_t profileWdt;
+persistent profile_t profileIoc;
+#endif
+
+#if USE_DOUBLE_PRESS
+// Whether the double-press window after a release is still open, and whether
+// the press being debounced started within it.
+unsigned char doubleWindow;
+unsigned char doublePress;
+#endif
+
+#if BOOT_POLICY == BOOT_RESTORE
+// The next EEPROM slot to write, the phase bit to write it with, and the power
+// state last saved.
+unsigned char stateSlot;
+unsigned char statePhase;
+unsigned char stateSaved;
 
 /* =============================================================================
- * Called when the ATX power button is pressed, and also when it is held.
- * 
- * param[in] holdCount How long (in ticks) the button has been held. 0 indicates
- *      the button has just been pressed.
+ * Finds the most recently saved power state in the EEPROM ring, and where the
+ * next one is to be saved. Only called once, at startup.
+ *
+ * returns 1 if the supply was last saved as on, 0 if off or never saved.
  * ===========================================================================*/
-void OnButtonPressed(int holdCount)
+unsigned char LoadPowerState(void)
 {
-    static unsigned char powerOffArmed = 0;
-    
-    if (poweredOn)
+    unsigned char slot;
+    unsigned char value;
+    unsigned char last = eeprom_read(STATE_RING_BASE);
+
+    // An unwritten first slot means nothing has ever been saved.
+    stateSlot = 0;
+    statePhase = 0;
+    stateSaved = 0;
+    if ((last & STATE_SLOT_MASK) != STATE_SLOT_MARK)
+    {
+        return 0;
+    }
+
+    // Walk forward to the first unwritten slot or change of phase.
+    for (slot = 1; slot < STATE_RING_SLOTS; slot++)
+    {
+        value = eeprom_read(STATE_RING_BASE + slot);
+        if (((value & STATE_SLOT_MASK) != STATE_SLOT_MARK) ||
+            ((value ^ last) & STATE_SLOT_PHASE))
+        {
+            break;
+        }
+        last = value;
+    }
+
+    // The next write goes in that slot, wrapping around with the phase flipped
+    // if the ring was full.
+    stateSlot = slot;
+    statePhase = last & STATE_SLOT_PHASE;
+    if (stateSlot == STATE_RING_SLOTS)
+    {
+        stateSlot = 0;
+        statePhase ^= STATE_SLOT_PHASE;
+    }
+
+    stateSaved = last & 1;
+    return stateSaved;
+}
+
+/* =============================================================================
+ * Saves the power state to the next EEPROM slot, if it has changed. The write
+ * finishes on its own, in sleep if need be, so this doesn't wait for it.
+ *
+ * param[in] powered 1 if the supply is on, 0 if off.
+ * ===========================================================================*/
+void SavePowerState(unsigned char powered)
+{
+    if (powered == stateSaved)
+    {
+        return;
+    }
+
+    eeprom_write(STATE_RING_BASE + stateSlot,
+                 STATE_SLOT_MARK | statePhase | powered);
+    stateSaved = powered;
+
+    if (++stateSlot == STATE_RING_SLOTS)
+    {
+        stateSlot = 0;
+        statePhase ^= STATE_SLOT_PHASE;
+    }
+}
+#endif
+
+#if USE_EVENT_LOG || USE_SERIAL_DEBUG
+/* =============================================================================
+ * Sends a byte on SERIAL_TX at SERIAL_BAUD, 8N1, by timing each bit in
+ * software. Clears the watchdog on every bit, as at 300 baud even a byte
+ * (33 ms) takes longer than the shortest watchdog tick (~14 ms).
+ *
+ * param[in] value The byte to send.
+ * ===========================================================================*/
+void SerialWrite(unsigned char value)
+{
+    // The start bit (0), the data bits from bit 0, and the stop bit (1).
+    unsigned int frame = ((unsigned int)value << 1) | 0x200;
+    unsigned char bits;
+
+    for (bits = 10; bits != 0; bits--)
+    {
+        CLRWDT();
+        SERIAL_TX = (frame & 1);
+        frame >>= 1;
+        _delay(SERIAL_BIT_DELAY);
+    }
+}
+#endif
+
+#if USE_SERIAL_DEBUG
+/* =============================================================================
+ * Sends a byte as two hex digits, for USE_SERIAL_DEBUG.
+ *
+ * param[in] value The byte to send.
+ * ===========================================================================*/
+void SerialHex(unsigned char value)
+{
+    unsigned char digit = value >> 4;
+
+    SerialWrite((digit < 10) ? ('0' + digit) : ('A' - 10 + digit));
+    digit = value & 0x0F;
+    SerialWrite((digit < 10) ? ('0' + digit) : ('A' - 10 + digit));
+}
+
+/* =============================================================================
+ * Sends a line of USE_SERIAL_DEBUG output: a tag letter, a value in hex, and
+ * CR LF.
+ *
+ * param[in] tag   The letter saying what the value is.
+ * param[in] value The value.
+ * ===========================================================================*/
+void SerialReport(unsigned char tag, unsigned char value)
+{
+    SerialWrite(tag);
+    SerialHex(value);
+    SerialWrite('\r');
+    SerialWrite('\n');
+}
+
+#if USE_WAKE_PROFILE
+/* =============================================================================
+ * Sends the wake counts as a line of USE_SERIAL_DEBUG output: P, then four hex
+ * digits for each of profileWakes, profilePressed, profileRejected, profileWdt
+ * and profileIoc, and CR LF.
+ * ===========================================================================*/
+void SendProfile(void)
+{
+    SerialWrite('P');
+    SerialHex(profileWakes >> 8);
+    SerialHex(profileWakes & 0xFF);
+    SerialHex(profilePressed >> 8);
+    SerialHex(profilePressed & 0xFF);
+    SerialHex(profileRejected >> 8);
+    SerialHex(profileRejected & 0xFF);
+    SerialHex(profileWdt >> 8);
+    SerialHex(profileWdt & 0xFF);
+    SerialHex(profileIoc >> 8);
+    SerialHex(profileIoc & 0xFF);
+    SerialWrite('\r');
+    SerialWrite('\n');
+}
+#endif
+#endif
+
+#if USE_EVENT_LOG
+// The next event log slot to write, and the wrap count to write it with.
+unsigned char logSlot;
+unsigned char logWrap;
+
+// The letter sent for each LOG_* event in the readout.
+const unsigned char logLetters[] = "NFXPRBW";
+
+/* =============================================================================
+ * Finds where the next event is to be logged. Only called once, at startup.
+ * ===========================================================================*/
+void FindLogSlot(void)
+{
+    unsigned char value;
+    unsigned char first = eeprom_read(EVENT_LOG_BASE);
+
+    // An unwritten first slot means nothing has ever been logged.
+    logSlot = 0;
+    logWrap = 0;
+    if (first == 0xFF)
     {
-        // If the button has just been pressed while power on, arm the power
-        // off sequence.
-        if (holdCount == 0)
+        return;
+    }
+
+    // Walk forward to the first unwritten slot or change of wrap count. If
+    // there is none, the ring is full, and wraps around to the first slot.
+    logWrap = first & 0xF0;
+    for (logSlot = 1; logSlot < EVENT_LOG_SLOTS; logSlot++)
+    {
+        value = eeprom_read(EVENT_LOG_BASE + logSlot);
+        if ((value == 0xFF) || ((value & 0xF0) != logWrap))
         {
-            powerOffArmed = 1;
+            return;
         }
-        
-        // See if the button has been held long enough to power off the supply.
-        if (powerOffArmed && (holdCount >= POWER_OFF_COUNT))
+    }
+    logSlot = 0;
+    logWrap += 0x10;
+}
+
+/* =============================================================================
+ * Writes an event to the next event log slot. As with SavePowerState, the
+ * write finishes on its own.
+ *
+ * param[in] logged The LOG_* event.
+ * ===========================================================================*/
+void LogEvent(unsigned char logged)
+{
+    eeprom_write(EVENT_LOG_BASE + logSlot, logWrap | logged);
+
+    if (++logSlot == EVENT_LOG_SLOTS)
+    {
+        logSlot = 0;
+        logWrap += 0x10;
+    }
+}
+
+/* =============================================================================
+ * Sends the event log on SERIAL_TX as a line of text, one logLetters letter per
+ * entry, oldest first.
+ * ===========================================================================*/
+void SendLog(void)
+{
+    unsigned char slot = logSlot;
+    unsigned char value;
+
+    do
+    {
+        value = eeprom_read(EVENT_LOG_BASE + slot);
+        if (value != 0xFF)
+        {
+            // A value from a later firmware, or a corrupt slot, is sent as ?.
+            value &= 0x0F;
+            SerialWrite((value < sizeof(logLetters) - 1) ?
+                        logLetters[value] : '?');
+        }
+        if (++slot == EVENT_LOG_SLOTS)
+        {
+            slot = 0;
+        }
+    } while (slot != logSlot);
+
+    SerialWrite('\r');
+    SerialWrite('\n');
+}
+#endif
+
+/* =============================================================================
+ * Drives the outputs to match the power state: the shutdown request, status LED
+ * and double press output, and, when the supply changes, PS_ON and the PWR_OK
+ * comparator. Called by OnEvent, and by RecoverState to put them right.
+ *
+ * param[in] power 1 to drive PS_ON and the comparator as well.
+ * ===========================================================================*/
+void DriveState(unsigned char power)
+{
+#if USE_SOFT_OFF
+    // Request the shutdown for as long as we wait for it. With IOC wake, the
+    // acknowledge wakes us at once.
+    SHUTDOWN_REQ = (powerState == STATE_SHUTDOWN);
+#if USE_IOC_WAKE
+    PIN_IOC(1, powerState == STATE_SHUTDOWN);
+#endif
+#endif
+
+#if USE_STATUS_LED
+    // Blinking starts lit, and carries on from the hold count in main.
+    STATUS_LED = (stateLed[powerState] != LED_OFF);
+#endif
+
+#if USE_DOUBLE_PRESS
+    if (powerState == STATE_DOUBLE)
+    {
+        DOUBLE_OUT_ON;
+    }
+    else
+    {
+        DOUBLE_OUT_OFF;
+    }
+#endif
+
+    if (!power)
+    {
+        return;
+    }
+
+    if (POWERED_ON)
+    {
+        POWER_ON;
+
+#if USE_PWR_OK
+        // Power up the comparator and its reference on GP1. Reading CMCON ends
+        // any mismatch from the mode change, so the flag can be cleared before
+        // letting the comparator wake us.
+        pwrOkSeen = 0;
+        ANSELbits.ANS1 = 1;
+        VRCON = PWR_OK_VRCON;
+        CMCON = PWR_OK_CMCON;
+        (void)CMCON;
+        PIR1bits.CMIF = 0;
+        PIE1bits.CMIE = 1;
+        INTCONbits.PEIE = 1;
+#endif
+    }
+    else
+    {
+        POWER_OFF;
+
+#if USE_PWR_OK
+        // Power the comparator and its reference back down.
+        PIE1bits.CMIE = 0;
+        CMCON = 0x07;
+        VRCON = 0;
+        ANSELbits.ANS1 = 0;
+#endif
+    }
+}
+
+/* =============================================================================
+ * Moves the state machine to its next state for an event, and drives the ATX
+ * power supply to match. Only called on events, never on idle wakes.
+ *
+ * param[in] event The EVENT_* that occurred.
+ * param[in] held  The hold count in ticks, reported with USE_SERIAL_DEBUG when
+ *                 a hold powers off.
+ * ===========================================================================*/
+void OnEvent(unsigned char event, ticks_t held)
+{
+    unsigned char wasPowered = POWERED_ON;
+#if USE_EVENT_LOG
+    unsigned char logged;
+#endif
+#if USE_SOFT_OFF || USE_SERIAL_DEBUG
+    unsigned char wasState = powerState;
+#endif
+
+    powerState = stateTransitions[powerState][event];
+    STATE_CHECK_UPDATE;
+
+#if USE_SOFT_OFF
+    // Start the shutdown timeout on the way in.
+    if ((powerState == STATE_SHUTDOWN) && (wasState != STATE_SHUTDOWN))
+    {
+        shutdownWakes = SOFT_OFF_WAKES;
+    }
+#endif
+
+    DriveState(POWERED_ON != wasPowered);
+
+    if (POWERED_ON == wasPowered)
+    {
+#if USE_SERIAL_DEBUG
+        if (powerState != wasState)
         {
-            POWER_OFF;
-            powerOffArmed = 0;
+            SerialReport('S', powerState);
         }
+#endif
+        return;
+    }
+
+    REMEMBER_POWERED(POWERED_ON);
+
+#if BOOT_POLICY == BOOT_RESTORE
+    SavePowerState(POWERED_ON);
+#endif
+
+#if USE_EVENT_LOG
+    if (POWERED_ON)
+    {
+        logged = LOG_POWER_ON;
+    }
+    else if (event == EVENT_FORCE_OFF)
+    {
+        logged = LOG_FORCE_OFF;
+    }
+    else if (event == EVENT_FAULT)
+    {
+        logged = LOG_FAULT;
+    }
+    else
+    {
+        logged = LOG_POWER_OFF;
+    }
+    LogEvent(logged);
+#endif
+
+#if USE_SERIAL_DEBUG
+    // Report the change once the supply has been driven, so it doesn't wait
+    // for the line to be sent, and the hold that powered off, if any.
+    SerialReport('S', powerState);
+    if (!POWERED_ON &&
+        ((event == EVENT_HOLD) || (event == EVENT_FORCE_OFF) ||
+         (event == EVENT_ACK)))
+    {
+        SerialReport('H', held);
+    }
+#if USE_WAKE_PROFILE
+    if (!POWERED_ON)
+    {
+        SendProfile();
+    }
+#endif
+#endif
+}
+
+#if USE_DUAL_CHANNEL
+/* =============================================================================
+ * Moves the second channel's state machine to its next state for an event, and
+ * drives its supply to match. None of the options apply to it.
+ *
+ * param[in] event The EVENT_* that occurred.
+ * ===========================================================================*/
+void OnEvent2(unsigned char event)
+{
+    powerState2 = stateTransitions[powerState2][event];
+
+    if (statePowered[powerState2])
+    {
+        POWER2_ON;
     }
     else
     {
-        // If the button has just been pressed while the supply was off, then
-        // power on the supply.
-        if (holdCount == 0)
+        POWER2_OFF;
+    }
+    REMEMBER_POWERED2(statePowered[powerState2]);
+}
+#endif
+
+#if USE_WDT_CALIBRATION
+/* =============================================================================
+ * Measures one watchdog tick with Timer1, which keeps counting through the
+ * watchdog reset that ends the measurement. Never returns: main reads Timer1
+ * after the reset, and then carries on as after the reset before this.
+ *
+ * param[in] cause The RESET_* cause to carry on with.
+ * ===========================================================================*/
+void CalibrateWdt(unsigned char cause)
+{
+    calCause = cause;
+    WDT_SET_PS(TICK_PS);
+    T1CON = 0;
+    TMR1H = 0;
+    TMR1L = 0;
+    T1CON = CAL_T1CON;
+    CLRWDT();
+    while (1)
+    {
+    }
+}
+
+/* =============================================================================
+ * Scales a number of nominal ticks to the measured watchdog tick, rounding to
+ * the nearest tick. This adds the nominal tick count by count and takes away
+ * whole measured ticks, so it needs neither a multiply nor a divide.
+ *
+ * param[in] count The number of nominal ticks.
+ *
+ * returns the number of measured ticks, saturating at TICKS_MAX.
+ * ===========================================================================*/
+ticks_t CalibratedTicks(ticks_t count)
+{
+    unsigned int sum = calPeriod >> 1;
+    ticks_t ticks = 0;
+
+    for (; count != 0; count--)
+    {
+        sum += CAL_NOMINAL;
+        while (sum >= calPeriod)
+        {
+            sum -= calPeriod;
+            if (ticks != TICKS_MAX)
+            {
+                ticks++;
+            }
+        }
+    }
+    return ticks;
+}
+#endif
+
+#if USE_INTEGRITY_CHECK
+/* =============================================================================
+ * Puts the power state, the remembered power state and the hold time right
+ * after one or more failed their checks on a wake. The state machine restarts
+ * from on or off, which loses an armed hold or a double press, but not the
+ * power state, and the outputs are driven to match it as on a change of state.
+ * ===========================================================================*/
+void RecoverState(void)
+{
+    // Whether PS_ON was on, to tell if recovering changes it.
+    unsigned char wasPowered = !PIN_TRIS(2);
+
+    if (!STATE_CHECK_VALID)
+    {
+        if (REMEMBERED_VALID)
         {
-            POWER_ON;
+            powerState = lastPowered ? STATE_ON : STATE_OFF;
         }
+        else
+        {
+            // Neither can be trusted, so keep the supply as it is.
+            powerState = wasPowered ? STATE_ON : STATE_OFF;
+        }
+        STATE_CHECK_UPDATE;
+    }
+    REMEMBER_POWERED(POWERED_ON);
+
+#if USE_HOLD_JUMPERS || USE_WDT_CALIBRATION
+    if (!HOLD_CHECK_VALID)
+    {
+        // Which of the two is wrong can't be told, so go back to the default.
+        powerOffCount = POWER_OFF_COUNT;
+        HOLD_CHECK_UPDATE;
+    }
+#endif
+
+    DriveState(1);
+    if (POWERED_ON != wasPowered)
+    {
+#if BOOT_POLICY == BOOT_RESTORE
+        SavePowerState(POWERED_ON);
+#endif
+#if USE_EVENT_LOG
+        LogEvent(POWERED_ON ? LOG_POWER_ON : LOG_POWER_OFF);
+#endif
     }
 }
+#endif
 
 /* =============================================================================
  * Main entry point.
  * ===========================================================================*/
 void main(void)
 {
+    unsigned char powerUp;
     unsigned char lastButtonState = 0;
-    unsigned int holdCount = 0;
+    ticks_t holdCount = 0;
+#if DEBOUNCE_TICKS
+    ticks_t debounce = 0;
+#endif
+#if USE_DOUBLE_PRESS || USE_SOFT_OFF
+    unsigned char timedOut;
+#endif
+#if USE_DUAL_CHANNEL
+    unsigned char lastButtonState2 = 0;
+    ticks_t holdCount2 = 0;
+#if DEBOUNCE_TICKS
+    ticks_t debounce2 = 0;
+#endif
+#endif
 
-    // OPTION Register:
-    // bit 7: GPIO pull-ups are enabled by individual port latches.
-    // bit 6: Interrupt on falling edge of GP2/INT (we don't care)
-    // bit 5: Internal instruction cycle clock (we don't care)
-    // bit 4: Increment on low-to-high transition on GP2/T0CKI (we don't care)
-    // bit 3: Pre-scaler assigned to WTD.
-    // bits 0-2: Set 1:2s WDT pre-scaler (doubles watchdog timeout value).
-    OPTION_REG = 0b00001001;
+    // Find out why we reset. The POR flag must be tested first, as the BOD
+    // flag is unknown after a power-on reset. MCLR is disabled, so anything
+    // else is a watchdog timeout while awake. Set both flags for next time.
+    if (!PCONbits.nPOR)
+    {
+        resetCause = RESET_POR;
+    }
+    else if (RESET_WAS_BOR)
+    {
+        resetCause = RESET_BOR;
+    }
+    else
+    {
+        resetCause = RESET_WDT;
+    }
+    RESET_FLAGS_SET;
+
+    // Run at 4 MHz, enable the weak pull-ups, and set the watchdog pre-scaler
+    // to TICK_PS (see Hardware Abstraction).
+    CLOCK_INIT;
+    WDT_INIT(TICK_PS);
 
     // Disable analog mode on all pins so that we can use them as digital pins.
-    ANSEL = 0;
+    ANALOG_OFF;
+
+#if USE_VSB_MONITOR
+    // Except for AN0, which reads the +5VSB reference. Its digital input is
+    // then off, so an analog level on it draws no current. Sample on the
+    // first wake with the supply on.
+    ANSEL = VSB_ANSEL;
+    vsbWakes = 1;
+#endif
+
+#if USE_INTEGRITY_CHECK
+    // Check on the first wake.
+    integrityWakes = 1;
+#endif
 
     // Set all GPIO outputs to 0.
-    GPIO = 0;
+    PORT_OUT = 0;
 
     // Completely disable the comparator to use the lowest power possible.
-    CMCON = 0x07;
+    COMPARATOR_OFF;
     
     // Set GP5 as an output (it is low) to serve as a ground for the switch.
-    TRISIO5 = 0;
+    PIN_TRIS(5) = 0;
 
     // Enable the weak pull-up on our switch input (GP4).
-    WPUbits.WPU4 = 1;    
+    PIN_WPU(4) = 1;    
+
+#if USE_DUAL_CHANNEL
+    // And on the second channel's switch input (GP1). Its PS_ON (GP0) is an
+    // input, which leaves that supply off.
+    PIN_WPU(1) = 1;
+#endif
 
-    // Start with the supply off.
+#if USE_HOLD_JUMPERS
+    // Read the hold time jumpers with the pull-ups on GP0 and GP1, giving them
+    // a few us to charge the pins. Then drive both pins low (GPIO is already
+    // 0) with the pull-ups off, so that neither a jumper nor an open pin draws
+    // current while asleep.
+    PIN_WPU(0) = 1;
+    PIN_WPU(1) = 1;
+    NOP();
+    NOP();
+    powerOffCount = holdOffCounts[PORT_IN & 0x03];
+    PIN_WPU(0) = 0;
+    PIN_WPU(1) = 0;
+    PIN_TRIS(0) = 0;
+    PIN_TRIS(1) = 0;
+#elif USE_WDT_CALIBRATION
+    powerOffCount = POWER_OFF_COUNT;
+#endif
+
+#if USE_AWAKE_PIN || USE_STATUS_LED || USE_SOFT_OFF
+    // Drive the awake pin, status LED or shutdown request, which starts low
+    // like the rest of GPIO.
+    PIN_TRIS(0) = 0;
+#endif
+
+#if USE_SOFT_OFF
+    // Pull up the host's acknowledge input. It only draws current while the
+    // host pulls it low.
+    PIN_WPU(1) = 1;
+#endif
+
+#if USE_TIMER1_HOLD
+    // Calibrate the internal oscillator, and set up Timer1 (stopped) to count
+    // instruction cycles.
+    OSC_TRIM;
+    T1CON = TMR1_PS << 4;
+#endif
+
+#if USE_WDT_CALIBRATION
+    if ((resetCause == RESET_WDT) && (calCause != RESET_NONE))
+    {
+        // The watchdog ended a measurement, so Timer1 holds one tick, plus the
+        // few us from the reset to here. Keep it if it is plausible.
+        T1CON = 0;
+        if ((TMR1H >= (CAL_MIN >> 8)) && (TMR1H < (CAL_MAX >> 8)))
+        {
+            calPeriod = ((unsigned int)TMR1H << 8) | TMR1L;
+            calPeriodCheck = ~calPeriod;
+        }
+        resetCause = calCause;
+    }
+    else if ((resetCause == RESET_POR) || !CAL_VALID)
+    {
+        // Start with the nominal tick, in case the measurement is ignored,
+        // then measure it, with the oscillator calibrated.
+        calPeriod = CAL_NOMINAL;
+        calPeriodCheck = ~CAL_NOMINAL;
+        OSC_TRIM;
+        CalibrateWdt(resetCause);
+    }
+    calCause = RESET_NONE;
+
+    // Scale the power off hold to the measured tick. It must stay longer than
+    // the debounce, and shorter than the force off hold.
+    powerOffCount = CalibratedTicks(powerOffCount);
+    if (powerOffCount <= DEBOUNCE_TICKS)
+    {
+        powerOffCount = DEBOUNCE_TICKS + 1;
+    }
+#if FORCE_OFF_TIME_MS
+    if (powerOffCount >= FORCE_OFF_COUNT)
+    {
+        powerOffCount = FORCE_OFF_COUNT - 1;
+    }
+#endif
+#if CALIBRATE_PERIOD_S
+    calWakes = CAL_WAKES;
+#endif
+#endif
+
+    // The hold time is now set, so keep its complement for USE_INTEGRITY_CHECK.
+    HOLD_CHECK_UPDATE;
+
+#if USE_EVENT_LOG
+    // Log the reset. A measurement of the watchdog tick carries on as the
+    // reset before it, which is logged already.
+    FindLogSlot();
+    if (resetCause != RESET_CAL)
+    {
+        LogEvent(LOG_POR + resetCause);
+    }
+
+    // Holding the switch as +5VSB comes up asks for the log. Send it with the
+    // oscillator trimmed, then again after each idle interval until the switch
+    // is released, so that a press isn't seen as the first press.
+    if ((resetCause == RESET_POR) && (SWITCH_INPUT == 0))
+    {
+        OSC_TRIM;
+        SERIAL_TX = 1;
+        PIN_TRIS(0) = 0;
+        do
+        {
+            SendLog();
+            WDT_SET_PS(IDLE_PS);
+            SLEEP();
+            NOP();
+            WDT_SET_PS(TICK_PS);
+        } while (SWITCH_INPUT == 0);
+#if !USE_SERIAL_DEBUG
+        SERIAL_TX = 0;
+#endif
+    }
+#endif
+
+#if USE_WAKE_PROFILE
+    // The counts start from zero at power-on. A measurement of the watchdog
+    // tick carries on as a power-on reset, so it clears them only once.
+    if (resetCause == RESET_POR)
+    {
+        profileWakes = 0;
+        profilePressed = 0;
+        profileRejected = 0;
+        profileWdt = 0;
+        profileIoc = 0;
+    }
+#endif
+
+#if USE_SERIAL_DEBUG
+    // Set up the serial output, idle high, with the oscillator trimmed for the
+    // bit timing, and report the reset.
+    OSC_TRIM;
+    SERIAL_TX = 1;
+    PIN_TRIS(0) = 0;
+    SerialReport('R', resetCause);
+#endif
+
+    // Start with the supply off, then apply the boot policy.
+    powerState = STATE_OFF;
+    STATE_CHECK_UPDATE;
     POWER_OFF;
 
+#if BOOT_POLICY == BOOT_RESTORE
+    powerUp = LoadPowerState();
+#else
+    powerUp = (BOOT_POLICY == BOOT_ON);
+#endif
+
+    // After a brown-out or watchdog reset, RAM has survived, so go back to the
+    // state we were in rather than following the boot policy. The reset has
+    // already released PS_ON, so this puts it back after only the init above.
+    if ((resetCause != RESET_POR) && REMEMBERED_VALID)
+    {
+        powerUp = lastPowered;
+    }
+
+    REMEMBER_POWERED(0);
+    if (powerUp)
+    {
+#if POWER_ON_SLOT
+        // Wait for this unit's slot, asleep for one tick at a time. The hold
+        // count isn't used yet, so it counts the ticks. The watchdog wakes us
+        // without a reset while asleep.
+        for (holdCount = POWER_ON_DELAY_TICKS; holdCount != 0; holdCount--)
+        {
+            if (SWITCH_INPUT == 0)
+            {
+                // A press powers on now. Mark it as already accepted, as if it
+                // had powered on from off, so that the main loop doesn't see it
+                // as a new press from on, and power off when it is held.
+                lastButtonState = 1;
+                holdCount = DEBOUNCE_TICKS;
+#if DEBOUNCE_TICKS
+                debounce = DEBOUNCE_MAX;
+#endif
+                break;
+            }
+            SLEEP();
+            NOP();
+        }
+#endif
+        OnEvent(EVENT_RESTORE, 0);
+    }
+
+#if USE_DUAL_CHANNEL
+    // The second channel only follows BOOT_ON, right after the first, but
+    // resumes after a brown-out or watchdog reset in the same way.
+    powerState2 = STATE_OFF;
+    powerUp = (BOOT_POLICY == BOOT_ON);
+    if ((resetCause != RESET_POR) && REMEMBERED2_VALID)
+    {
+        powerUp = lastPowered2;
+    }
+    REMEMBER_POWERED2(0);
+    if (powerUp)
+    {
+        OnEvent2(EVENT_RESTORE);
+    }
+#endif
+
+#if USE_IOC_WAKE
+    // Wake on any change of the switch input. GIE stays clear, so the wake
+    // simply resumes after SLEEP() instead of vectoring to an interrupt.
+    PIN_IOC(4, 1);
+#if USE_DUAL_CHANNEL
+    PIN_IOC(1, 1);
+#endif
+#endif
+
+    // Nothing is being timed yet, unless a press ended the power on wait.
+#if POWER_ON_SLOT
+    if (!BUTTON_TIMING)
+#endif
+    {
+        ENTER_IDLE;
+    }
+
     // Loop forever.
     while (1)
     {
+#if USE_DOUBLE_PRESS || USE_SOFT_OFF
+        // Whether the watchdog woke us, rather than IOC, before CLRWDT() clears
+        // the flag.
+        timedOut = !STATUSbits.nTO;
+#endif
+
+#if USE_WAKE_PROFILE
+        // Count the wake and what woke us, also before CLRWDT() sets the flags.
+        // A wake from sleep that isn't a timeout is IOC; neither is set after
+        // a Timer1 tick, which doesn't sleep.
+        PROFILE_COUNT(profileWakes);
+        if (!STATUSbits.nTO)
+        {
+            PROFILE_COUNT(profileWdt);
+        }
+        else if (!STATUSbits.nPD)
+        {
+            PROFILE_COUNT(profileIoc);
+        }
+        if (SWITCH_INPUT == 0)
+        {
+            PROFILE_COUNT(profilePressed);
+        }
+#endif
+
         // Clear the watchdog timer, giving us plenty of time to what we need to.
         CLRWDT();
 
+#if USE_IOC_WAKE
+        // On devices where the IOC flags latch edges, clear them before the
+        // pins are sampled (see IOC_CLEAR_ON_WAKE).
+        IOC_CLEAR_ON_WAKE;
+#endif
+
+#if USE_INTEGRITY_CHECK
+        // Every INTEGRITY_WAKES wakes, check the state, and set the switch pins
+        // and OPTION_REG again, in case anything was upset while asleep.
+        if (--integrityWakes == 0)
+        {
+            integrityWakes = INTEGRITY_WAKES;
+            if (!STATE_CHECK_VALID || !REMEMBERED_VALID || !HOLD_CHECK_VALID)
+            {
+                RecoverState();
+            }
+            PIN_OUT(2) = 0;
+            PIN_OUT(5) = 0;
+            PIN_TRIS(5) = 0;
+            PIN_WPU(4) = 1;
+            OPTION_REFRESH;
+        }
+
+        // Drive PS_ON to match the remembered power state on every wake.
+        PIN_TRIS(2) = !lastPowered;
+#endif
+
+#if USE_DOUBLE_PRESS
+        // The window times out without a press, so go on to the idle interval.
+        if (doubleWindow && timedOut)
+        {
+            doubleWindow = 0;
+            WDT_SET_PS(IDLE_PS);
+        }
+#endif
+
+#if USE_AWAKE_PIN
+        AWAKE_PIN = 1;
+#endif
+
+#if USE_PWR_OK
+        // The comparator changed, so PWR_OK either came up or dropped. Reading
+        // COUT ends the mismatch condition, so the flag can be cleared.
+        if (PIR1bits.CMIF)
+        {
+            if (CMCONbits.COUT)
+            {
+                pwrOkSeen = 1;
+            }
+            else if (pwrOkSeen)
+            {
+                OnEvent(EVENT_FAULT, 0);
+            }
+            PIR1bits.CMIF = 0;
+        }
+#endif
+
+#if USE_VSB_MONITOR
+        // Every VSB_SAMPLE_WAKES wakes while the supply is on, power up the
+        // ADC, let it acquire the reference, and convert it. If +5VSB has
+        // sagged, release PS_ON as a fault, before a brown-out reset does.
+        if (POWERED_ON && (--vsbWakes == 0))
+        {
+            vsbWakes = VSB_SAMPLE_WAKES;
+            ADCON0 = VSB_ADCON0;
+            _delay(VSB_ACQ_CYCLES);
+            ADCON0bits.GO_nDONE = 1;
+            while (ADCON0bits.GO_nDONE)
+            {
+            }
+            ADCON0 = 0;
+
+            if (ADRESH > VSB_LOW_CODE)
+            {
+                OnEvent(EVENT_FAULT, 0);
+            }
+        }
+#endif
+
+#if USE_SOFT_OFF
+        // While waiting for the host, give up after SOFT_OFF_WAKES idle wakes.
+        // Only watchdog timeouts count, not IOC wakes from the button or the
+        // acknowledge line, nor ticks that time the button.
+        if ((powerState == STATE_SHUTDOWN) &&
+            ((HOST_ACK == 0) ||
+             (!BUTTON_TIMING && timedOut && (--shutdownWakes == 0))))
+        {
+            OnEvent(EVENT_ACK, holdCount);
+        }
+#endif
+
         // Poll the input pin. The logic is inverted (high means not pressed).
-        if (SWITCH_INPUT == 1)
+#if DEBOUNCE_TICKS
+        // Integrate the samples, counting up while pressed and down while
+        // released. Leave the idle interval on the first pressed sample, and
+        // return to it once the count is back to zero.
+        if (SWITCH_INPUT == 0)
+        {
+            if (debounce == 0)
+            {
+                LEAVE_IDLE;
+#if USE_DOUBLE_PRESS
+                // The press started within the window if it is still open.
+                doublePress = doubleWindow;
+                doubleWindow = 0;
+#endif
+            }
+            if (debounce != DEBOUNCE_MAX)
+            {
+                debounce++;
+            }
+        }
+        else if (debounce != 0)
+        {
+            if (--debounce == 0)
+            {
+                ENTER_IDLE;
+#if USE_WAKE_PROFILE
+                // Settled back to released without being accepted as pressed.
+                if (!lastButtonState)
+                {
+                    PROFILE_COUNT(profileRejected);
+                }
+#endif
+            }
+        }
+#endif
+
+        if (BUTTON_RELEASED)
+        {
+            if (lastButtonState)
+            {
+                // The switch has just been released.
+                lastButtonState = 0;
+                OnEvent(EVENT_RELEASE, 0);
+
+#if !DEBOUNCE_TICKS
+                // There is nothing left to time.
+                ENTER_IDLE;
+#endif
+
+#if USE_DOUBLE_PRESS
+                // Open the double-press window, sleeping for just its length.
+                doubleWindow = 1;
+                WDT_SET_PS(DOUBLE_PS);
+#endif
+            }
+        }
+        else if (!lastButtonState)
         {
-            lastButtonState = 0;
+            if (BUTTON_PRESSED)
+            {
+                // The switch has just been pressed. It was first seen low
+                // DEBOUNCE_TICKS ticks ago, so count the hold from there.
+                lastButtonState = 1;
+                holdCount = DEBOUNCE_TICKS;
+#if !DEBOUNCE_TICKS
+                LEAVE_IDLE;
+#if USE_DOUBLE_PRESS
+                doublePress = doubleWindow;
+                doubleWindow = 0;
+#endif
+#endif
+#if USE_DOUBLE_PRESS
+                if (doublePress)
+                {
+                    OnEvent(EVENT_DOUBLE, 0);
+                }
+                else
+#endif
+                {
+                    OnEvent(EVENT_PRESS, 0);
+                }
+            }
         }
         else
         {
-            // If the switch has just been pressed, reset the hold count.
-            if (!lastButtonState)
+            // The switch is still held. Count the tick, saturating rather than
+            // wrapping so that a very long hold stays a long hold, and send the
+            // hold events once when the count reaches the power off and force
+            // off times.
+            if (holdCount != TICKS_MAX)
             {
-                holdCount = 0;
+                holdCount++;
+
+                if (holdCount == HOLD_OFF_COUNT)
+                {
+                    OnEvent(EVENT_HOLD, holdCount);
+                }
+#if FORCE_OFF_TIME_MS
+                else if (holdCount == FORCE_OFF_COUNT)
+                {
+                    OnEvent(EVENT_FORCE_OFF, holdCount);
+                }
+#endif
             }
 
-            // Indicate that the button is pressed.
-            OnButtonPressed(holdCount++);
-            
-            lastButtonState = 1;
+#if USE_STATUS_LED
+            if (stateLed[powerState] == LED_BLINK)
+            {
+                STATUS_LED = !(holdCount & LED_BLINK_BIT);
+            }
+#endif
         }
 
-        // Go to sleep. We'll wake up when the watchdog fires.
-        SLEEP();
+#if USE_DUAL_CHANNEL
+        // The second channel, in the same way as the first above.
+#if DEBOUNCE_TICKS
+        if (SWITCH2_INPUT == 0)
+        {
+            if (debounce2 == 0)
+            {
+                LEAVE_IDLE;
+            }
+            if (debounce2 != DEBOUNCE_MAX)
+            {
+                debounce2++;
+            }
+        }
+        else if (debounce2 != 0)
+        {
+            if (--debounce2 == 0)
+            {
+                ENTER_IDLE;
+            }
+        }
+#endif
 
-        // Some sources say a NOP is recommended after resuming from sleep. Not
-        // sure if this is needed or not, but it doesn't hurt anything.
-        NOP();
+        if (BUTTON2_RELEASED)
+        {
+            if (lastButtonState2)
+            {
+                lastButtonState2 = 0;
+                OnEvent2(EVENT_RELEASE);
+#if !DEBOUNCE_TICKS
+                ENTER_IDLE;
+#endif
+            }
+        }
+        else if (!lastButtonState2)
+        {
+            if (BUTTON2_PRESSED)
+            {
+                lastButtonState2 = 1;
+                holdCount2 = DEBOUNCE_TICKS;
+#if !DEBOUNCE_TICKS
+                LEAVE_IDLE;
+#endif
+                OnEvent2(EVENT_PRESS);
+            }
+        }
+        else if (holdCount2 != TICKS_MAX)
+        {
+            holdCount2++;
+
+            if (holdCount2 == HOLD_OFF_COUNT)
+            {
+                OnEvent2(EVENT_HOLD);
+            }
+#if FORCE_OFF_TIME_MS
+            else if (holdCount2 == FORCE_OFF_COUNT)
+            {
+                OnEvent2(EVENT_FORCE_OFF);
+            }
+#endif
+        }
+#endif
+
+#if CALIBRATE_PERIOD_S
+        // Every CAL_WAKES wakes with the supply off, measure the watchdog tick
+        // again. This ends in a reset, which carries on in the off state like
+        // a watchdog reset, but isn't logged as one.
+        if ((powerState == STATE_OFF) && !BUTTON_TIMING && (--calWakes == 0))
+        {
+            CalibrateWdt(RESET_CAL);
+        }
+#endif
+
+#if USE_IOC_WAKE
+        // Reading the switch above ended the mismatch condition, so the flag
+        // can be cleared. If the switch changed since, the flag is set again
+        // right away and we wake at once, so no edge is missed.
+        IOC_CLEAR_TO_SLEEP;
+#endif
+
+#if USE_ASM_IDLE
+        if (!BUTTON_TIMING)
+        {
+            // Nothing is being timed, so sleep in the assembly loop, doing on
+            // each wake what the C loop does when idle, until a wake finds the
+            // switch pressed. Then carry on in C, which samples it again. GPIO
+            // and INTCON are both in bank 0.
+            asm("asm_idle_loop:");
+            asm("CLRWDT");
+            asm("BANKSEL(_GPIO)");
+#if USE_AWAKE_PIN
+            asm("BSF BANKMASK(_GPIO),0");
+#endif
+            asm("BTFSS BANKMASK(_GPIO),4");
+            asm("GOTO asm_idle_done");
+#if USE_IOC_WAKE
+            asm("BCF BANKMASK(_INTCON),0");
+#endif
+#if USE_AWAKE_PIN
+            asm("BCF BANKMASK(_GPIO),0");
+#endif
+            asm("SLEEP");
+            asm("NOP");
+            asm("GOTO asm_idle_loop");
+            asm("asm_idle_done:");
+        }
+        else
+#endif
+#if USE_TIMER1_HOLD
+        if (TIMING_ANY)
+        {
+            // Wait one tick on Timer1. Restarting it costs the few us spent
+            // awake above, which is well within the oscillator's accuracy.
+            T1CONbits.TMR1ON = 0;
+            TMR1H = TMR1_PRELOAD >> 8;
+            TMR1L = TMR1_PRELOAD & 0xFF;
+            PIR1bits.TMR1IF = 0;
+            T1CONbits.TMR1ON = 1;
+            while (!PIR1bits.TMR1IF)
+            {
+                CLRWDT();
+            }
+        }
+        else
+#endif
+        {
+#if USE_AWAKE_PIN
+            AWAKE_PIN = 0;
+#endif
+
+            // Go to sleep. We'll wake up when the watchdog fires, or when the
+            // switch changes if IOC wake is enabled.
+            SLEEP();
+
+            // Some sources say a NOP is recommended after resuming from sleep.
+            // Not sure if this is needed or not, but it doesn't hurt anything.
+            NOP();
+        }
     }
 }
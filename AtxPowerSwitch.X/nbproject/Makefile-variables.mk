@@ -8,3 +8,7 @@ CND_BASEDIR=`pwd`
 CND_ARTIFACT_DIR_default=dist/default/production
 CND_ARTIFACT_NAME_default=AtxPowerSwitch.X.production.hex
 CND_ARTIFACT_PATH_default=dist/default/production/AtxPowerSwitch.X.production.hex
+# PIC12F1840 configuration
+CND_ARTIFACT_DIR_PIC12F1840=dist/PIC12F1840/production
+CND_ARTIFACT_NAME_PIC12F1840=AtxPowerSwitch.X.production.hex
+CND_ARTIFACT_PATH_PIC12F1840=dist/PIC12F1840/production/AtxPowerSwitch.X.production.hex
@@ -0,0 +1,1111 @@
+/* =============================================================================
+ * Trace harness for AtxPowerSwitch.
+ *
+ * Builds the firmware for the host against the mock <xc.h> in this directory,
+ * with the firmware's main() renamed fw_main(), and replays scripted button
+ * traces through it. Time only moves in SLEEP(), _delay() and the watchdog:
+ * SLEEP() sleeps until the watchdog times out, or until the switch changes if
+ * the IOC wake is enabled, and every PS_ON edge is recorded at the simulated
+ * time it happened. A brown-out in a trace resets the firmware with its
+ * persistent variables kept and the rest of its RAM cleared, as on the PIC.
+ *
+ * For each trace, the harness checks the PS_ON edges against the trace's
+ * expected timeline, within a tolerance (one tick by default), and reports:
+ * - the wakes, and wakes per second,
+ * - the awake budget: register accesses and basic blocks per wake, from each
+ *   wake to the next SLEEP(), on idle wakes (switch released when woken) and
+ *   held wakes,
+ * - the press-to-PS_ON latency, and the hold-to-off latency,
+ * - the estimated awake cycles per idle wake, and from all the awake time, the
+ *   estimated standby current and charge per day (see EstimateMicroamps).
+ *
+ * With -c, each trace's results are also added to a CSV file as one row (see
+ * CSV_HEADER), which make results keeps in results.csv, so that the cost of
+ * each change shows in its diff.
+ *
+ * These counts are a proxy for the awake window, not a cycle count: the host
+ * can't count PIC instruction cycles. They do track the cost of a change to
+ * the main loop. The firmware is built with -fsanitize-coverage=trace-pc, which
+ * calls __sanitizer_cov_trace_pc() at each basic block it runs.
+ *
+ * usage: harness [-v variant] [-t tolerance_ms] [-w wdt_ms] [-p pwrt_ms]
+ *                [-c results.csv] trace...
+ * ===========================================================================*/
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xc.h"
+
+void fw_main(void);
+
+// Weak, as the revisions that make history replays may not have it.
+extern unsigned char powerState __attribute__((weak));
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define MAX_EVENTS          (256)
+#define MAX_EDGES           (256)
+
+// Register accesses in one awake window that mean the firmware is stuck, e.g.
+// polling Timer1, which isn't simulated.
+#define STUCK_ACCESSES      (1000000UL)
+
+// The standby model: the datasheet's typical WDT and BOR currents in sleep,
+// and the current while awake, at 5 V and 4 MHz, where an instruction cycle is
+// 1 us. The assembly idle loop is run instruction by instruction, so its cycles
+// are exact; a basic block of the C firmware is taken as CYCLES_PER_BLOCK
+// cycles, an assumption that makes the C figures estimates, not measurements.
+#define WDT_UA              (9.0)
+#define BOR_UA              (58.0)
+#define AWAKE_UA            (500.0)
+#define CYCLES_PER_BLOCK    (5)
+
+// The columns of a CSV row, written once to a new file. Latencies are in ms,
+// and empty if there was no such edge.
+#define CSV_HEADER          "variant,trace,result,seconds,wakes,wakes_per_s," \
+                            "idle_accesses,idle_blocks,held_accesses," \
+                            "held_blocks,max_accesses,on_ms,off_ms," \
+                            "idle_cycles_est,wake_ua_est,ua_est,mah_per_day_est"
+
+// The sources of each event in a trace.
+#define EV_SWITCH           (0)     // Switch 1 (GP4) level: 0 pressed.
+#define EV_SWITCH2          (1)     // Switch 2 (GP1) level: 0 pressed.
+#define EV_BROWNOUT         (2)     // Vdd below VBOR, for value ms.
+#define EV_UPSET            (3)     // An upset releases PS_ON and clears RAM.
+
+// The reset causes the harness can apply.
+#define RESET_POR           (0)
+#define RESET_BOR           (1)
+#define RESET_WDT           (2)
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef unsigned long long us_t;
+
+typedef struct
+{
+    us_t time;
+    int kind;
+    long value;
+} event_t;
+
+typedef struct
+{
+    int channel;            // 1 for PS_ON (GP2), 2 for PS_ON2 (GP0).
+    int on;
+    us_t time;
+} edge_t;
+
+// The awake windows of one kind, and their totals.
+typedef struct
+{
+    unsigned long count;
+    unsigned long accesses;
+    unsigned long blocks;
+    unsigned long cycles;
+} window_t;
+
+typedef struct
+{
+    const char *name;
+    event_t events[MAX_EVENTS];
+    int eventCount;
+    edge_t expected[MAX_EDGES];
+    int expectedCount;
+    int variantExpected;    // The expected edges are the variant's own.
+    int checkChannel2;
+    us_t end;
+} trace_t;
+
+//=============================================================================
+// Globals
+//=============================================================================
+
+// Settings, from the command line.
+static const char *variant = "default";
+static us_t tolerance = 36000;
+static us_t wdtBase = 18000;
+static us_t powerUpTimer = 72000;
+
+// The simulated device.
+static mock_reg_t regs[MOCK_REGS];
+static unsigned char latch;         // The GPIO output latches.
+static unsigned char presented;     // The GPIO value last read.
+static int gpioPending;             // GPIO was last accessed, maybe written.
+static unsigned char eeprom[128];
+
+// The assembly block being collected, and the label that ends it.
+static char lines[32][64];
+static int lineCount;
+static char exitLabel[64];
+static int switch1;
+static int switch2;
+static int powered[3];              // PS_ON state, by channel.
+static us_t now;
+static us_t wdtDeadline;
+
+// The trace being run.
+static trace_t *trace;
+static int nextEvent;
+static jmp_buf resetJump;
+static jmp_buf endJump;
+static edge_t edges[MAX_EDGES];
+static int edgeCount;
+
+// The measurements.
+static unsigned long accesses;
+static unsigned long blocks;
+static unsigned long windowStart;
+static unsigned long windowBlocks;
+static unsigned long cycles;        // Estimated, see CYCLES_PER_BLOCK.
+static unsigned long windowCycles;
+static int inWindow;
+static int windowIdle;
+static unsigned long wakes;
+static window_t idle;
+static window_t held;
+static unsigned long maxAccesses;
+static long onLatency;               // From the press, in ms, or -1.
+static long offLatency;
+
+// The firmware's RAM, as sections of the firmware object (see the Makefile):
+// cleared or initialized RAM, reloaded on each reset, and the persistent
+// variables, which are only cleared at power-on.
+extern char __start_fw_bss[] __attribute__((weak));
+extern char __stop_fw_bss[] __attribute__((weak));
+extern char __start_fw_data[] __attribute__((weak));
+extern char __stop_fw_data[] __attribute__((weak));
+extern char __start_fw_keep[] __attribute__((weak));
+extern char __stop_fw_keep[] __attribute__((weak));
+#define SECTION_SIZE(name)  ((size_t)(__stop_##name - __start_##name))
+static char *bssImage;
+static char *dataImage;
+
+/* =============================================================================
+ * Reports a fatal harness error, and exits.
+ * ===========================================================================*/
+static void Fail(const char *message, const char *detail)
+{
+    fprintf(stderr, "harness: %s%s%s\n", message, detail ? ": " : "",
+            detail ? detail : "");
+    exit(2);
+}
+
+/* =============================================================================
+ * Returns the level on each GPIO pin. Outputs read their latches. Inputs are
+ * high, from a pull-up or the ATX supply's own pull-up on PS_ON, except a
+ * switch input while its switch is closed, which reads GP5.
+ * ===========================================================================*/
+static unsigned char Pins(void)
+{
+    unsigned char tris = regs[MOCK_TRISIO].byte & 0x3F;
+    unsigned char pins = (latch & ~tris) | tris;
+    unsigned char gp5 = (pins >> 5) & 1;
+
+    if (!switch1 && !gp5)
+    {
+        pins &= ~0x10;
+    }
+    if (!switch2 && !gp5 && (tris & 0x02))
+    {
+        pins &= ~0x02;
+    }
+    return pins & 0x3F;
+}
+
+/* =============================================================================
+ * Sets GPIF if an IOC-enabled pin no longer matches the last read of GPIO.
+ * ===========================================================================*/
+static void UpdateIoc(void)
+{
+    if ((Pins() ^ presented) & regs[MOCK_IOC].byte & 0x3F)
+    {
+        regs[MOCK_INTCON].intcon.GPIF = 1;
+    }
+}
+
+/* =============================================================================
+ * Records the PS_ON edges since the last call. A channel is on while its pin
+ * is an output driving low. GP0 is only PS_ON2 in traces that check it; other
+ * builds use it for outputs of their own.
+ * ===========================================================================*/
+static void RecordEdges(void)
+{
+    static const unsigned char channelPins[3] = { 0, 0x04, 0x01 };
+    unsigned char tris = regs[MOCK_TRISIO].byte;
+    int channel;
+    int on;
+
+    for (channel = 1; channel <= (trace->checkChannel2 ? 2 : 1); channel++)
+    {
+        on = !(tris & channelPins[channel]) && !(latch & channelPins[channel]);
+        if (on != powered[channel])
+        {
+            powered[channel] = on;
+            if (edgeCount == MAX_EDGES)
+            {
+                Fail("too many PS_ON edges in", trace->name);
+            }
+            edges[edgeCount].channel = channel;
+            edges[edgeCount].on = on;
+            edges[edgeCount].time = now;
+            edgeCount++;
+        }
+    }
+}
+
+/* =============================================================================
+ * Finishes the previous register access. A GPIO access hands out the pins; if
+ * the value was then changed, it was a write, which on the PIC writes every
+ * bit of the port into the latches, as a read-modify-write of one bit does.
+ * ===========================================================================*/
+static void Sync(void)
+{
+    if (gpioPending)
+    {
+        if (regs[MOCK_GPIO].byte != presented)
+        {
+            latch = regs[MOCK_GPIO].byte & 0x3F;
+        }
+        gpioPending = 0;
+    }
+    RecordEdges();
+    UpdateIoc();
+}
+
+/* =============================================================================
+ * Counts a register access by the firmware, and returns the register.
+ * ===========================================================================*/
+mock_reg_t *mock_reg(int reg)
+{
+    Sync();
+    accesses++;
+    if (accesses - windowStart > STUCK_ACCESSES)
+    {
+        Fail("firmware stuck awake in", trace->name);
+    }
+
+    if (reg == MOCK_GPIO)
+    {
+        presented = Pins();
+        regs[MOCK_GPIO].byte = presented;
+        gpioPending = 1;
+    }
+    return &regs[reg];
+}
+
+/* =============================================================================
+ * Counts a basic block run by the firmware.
+ * ===========================================================================*/
+void __sanitizer_cov_trace_pc(void)
+{
+    blocks++;
+    cycles += CYCLES_PER_BLOCK;
+}
+
+/* =============================================================================
+ * Returns the watchdog timeout for the current pre-scaler, in us.
+ * ===========================================================================*/
+static us_t WdtPeriod(void)
+{
+    unsigned char option = regs[MOCK_OPTION_REG].byte;
+
+    return (option & 0x08) ? (wdtBase << (option & 0x07)) : wdtBase;
+}
+
+/* =============================================================================
+ * Resets the device, with the registers at their reset values, and restarts
+ * the firmware. A brown-out releases PS_ON for the length of the brown-out,
+ * then the power-up timer.
+ *
+ * param[in] cause  The RESET_* cause.
+ * param[in] length How long the device is held in reset, in us.
+ * ===========================================================================*/
+static void Reset(int cause, us_t length)
+{
+    memset(regs, 0, sizeof(regs));
+    regs[MOCK_TRISIO].byte = 0x3F;
+    regs[MOCK_WPU].byte = 0x37;
+    regs[MOCK_OPTION_REG].byte = 0xFF;
+    regs[MOCK_ANSEL].byte = 0x0F;
+    regs[MOCK_OSCCAL].byte = 0x80;
+    regs[MOCK_PCON].pcon.nPOR = (cause != RESET_POR);
+    regs[MOCK_PCON].pcon.nBOD = (cause == RESET_WDT);
+    regs[MOCK_STATUS].status.nTO = (cause != RESET_WDT);
+    regs[MOCK_STATUS].status.nPD = 1;
+    gpioPending = 0;
+    lineCount = 0;
+    exitLabel[0] = 0;
+    RecordEdges();
+
+    now += length;
+    if (now >= trace->end)
+    {
+        now = trace->end;
+        longjmp(endJump, 1);
+    }
+
+    if (bssImage)
+    {
+        memcpy(__start_fw_bss, bssImage, SECTION_SIZE(fw_bss));
+    }
+    if (dataImage)
+    {
+        memcpy(__start_fw_data, dataImage, SECTION_SIZE(fw_data));
+    }
+    if ((cause == RESET_POR) && SECTION_SIZE(fw_keep))
+    {
+        memset(__start_fw_keep, 0, SECTION_SIZE(fw_keep));
+    }
+    inWindow = 0;
+    wdtDeadline = now + WdtPeriod();
+    longjmp(resetJump, 1);
+}
+
+/* =============================================================================
+ * Moves simulated time on, applying the trace's events on the way. Ends the
+ * trace at its end time.
+ *
+ * param[in] until    The time to move on to, in us.
+ * param[in] sleeping 1 to stop at an IOC wake.
+ *
+ * returns 1 if an IOC wake stopped it early, 0 if it reached the time.
+ * ===========================================================================*/
+static int Advance(us_t until, int sleeping)
+{
+    event_t *event;
+
+    while ((nextEvent < trace->eventCount) &&
+           (trace->events[nextEvent].time <= until) &&
+           (trace->events[nextEvent].time < trace->end))
+    {
+        event = &trace->events[nextEvent++];
+        if (event->time > now)
+        {
+            now = event->time;
+        }
+
+        switch (event->kind)
+        {
+        case EV_SWITCH:
+            switch1 = (int)event->value;
+            break;
+
+        case EV_SWITCH2:
+            switch2 = (int)event->value;
+            break;
+
+        case EV_BROWNOUT:
+            Reset(RESET_BOR, (us_t)event->value * 1000 + powerUpTimer);
+            break;
+
+        case EV_UPSET:
+            // Release PS_ON, and clear the power state (to off) without its
+            // complement, for USE_INTEGRITY_CHECK to find on the next wake.
+            regs[MOCK_TRISIO].byte |= 0x04;
+            if (&powerState != NULL)
+            {
+                powerState = 0;
+            }
+            RecordEdges();
+            break;
+        }
+
+        UpdateIoc();
+        if (sleeping && regs[MOCK_INTCON].intcon.GPIE &&
+            regs[MOCK_INTCON].intcon.GPIF)
+        {
+            return 1;
+        }
+    }
+
+    if (until >= trace->end)
+    {
+        now = trace->end;
+        longjmp(endJump, 1);
+    }
+    now = until;
+    return 0;
+}
+
+/* =============================================================================
+ * CLRWDT: restarts the watchdog, and sets the TO and PD flags.
+ * ===========================================================================*/
+void mock_clrwdt(void)
+{
+    Sync();
+    regs[MOCK_STATUS].status.nTO = 1;
+    regs[MOCK_STATUS].status.nPD = 1;
+    wdtDeadline = now + WdtPeriod();
+}
+
+/* =============================================================================
+ * SLEEP: ends the awake window, and sleeps until the watchdog times out or an
+ * IOC wake. If GPIF is already set with GPIE, it completes as a NOP.
+ * ===========================================================================*/
+void mock_sleep(void)
+{
+    window_t *kind = windowIdle ? &idle : &held;
+    us_t period;
+
+    Sync();
+    if (inWindow)
+    {
+        kind->count++;
+        kind->accesses += accesses - windowStart;
+        kind->blocks += blocks - windowBlocks;
+        kind->cycles += cycles - windowCycles;
+        if (accesses - windowStart > maxAccesses)
+        {
+            maxAccesses = accesses - windowStart;
+        }
+    }
+
+    if (!(regs[MOCK_INTCON].intcon.GPIE && regs[MOCK_INTCON].intcon.GPIF))
+    {
+        period = WdtPeriod();
+        regs[MOCK_STATUS].status.nTO = 1;
+        regs[MOCK_STATUS].status.nPD = 0;
+        if (Advance(now + period, 1))
+        {
+            wdtDeadline = now + period;
+        }
+        else
+        {
+            regs[MOCK_STATUS].status.nTO = 0;
+            wdtDeadline = now + WdtPeriod();
+        }
+        RecordEdges();
+    }
+
+    wakes++;
+    inWindow = 1;
+    windowStart = accesses;
+    windowBlocks = blocks;
+    windowCycles = cycles;
+    windowIdle = switch1 && switch2;
+}
+
+/* =============================================================================
+ * _delay: waits for a number of instruction cycles (1 us each at 4 MHz). The
+ * watchdog resets the device if it times out first.
+ * ===========================================================================*/
+void mock_delay(unsigned long cycles)
+{
+    Sync();
+    if (now + cycles >= wdtDeadline)
+    {
+        Advance(wdtDeadline, 0);
+        Reset(RESET_WDT, 0);
+    }
+    Advance(now + cycles, 0);
+}
+
+/* =============================================================================
+ * Returns the register an assembly operand such as BANKMASK(_GPIO) names.
+ * ===========================================================================*/
+static int AsmRegister(const char *operand)
+{
+    if (strncmp(operand, "BANKMASK(_GPIO)", 15) == 0)
+    {
+        return MOCK_GPIO;
+    }
+    if (strncmp(operand, "BANKMASK(_INTCON)", 17) == 0)
+    {
+        return MOCK_INTCON;
+    }
+    Fail("unsupported assembly operand", operand);
+    return 0;
+}
+
+/* =============================================================================
+ * Runs an assembly block: the USE_ASM_IDLE loop, with the instructions it uses.
+ * Each asm() line of the firmware is collected, and the block runs when the
+ * label it jumps out to arrives, which is where it ends.
+ * ===========================================================================*/
+void mock_asm(const char *line)
+{
+    char label[64];
+    const char *operand;
+    mock_reg_t *reg;
+    int bit;
+    int pc;
+    int target;
+
+    if (lineCount == 32)
+    {
+        Fail("assembly block too long", line);
+    }
+    strncpy(lines[lineCount], line, sizeof(lines[0]) - 1);
+    lineCount++;
+
+    // A jump to a label that isn't in the block yet is the way out of it.
+    if (strncmp(line, "GOTO ", 5) == 0)
+    {
+        for (target = 0; target < lineCount; target++)
+        {
+            snprintf(label, sizeof(label), "%s:", line + 5);
+            if (strcmp(lines[target], label) == 0)
+            {
+                break;
+            }
+        }
+        if (target == lineCount)
+        {
+            snprintf(exitLabel, sizeof(exitLabel), "%s:", line + 5);
+        }
+    }
+    if (!exitLabel[0] || (strcmp(line, exitLabel) != 0))
+    {
+        return;
+    }
+
+    for (pc = 0; pc < lineCount - 1; pc++)
+    {
+        line = lines[pc];
+        operand = strchr(line, ' ');
+        operand = operand ? operand + 1 : "";
+        bit = strchr(operand, ',') ? atoi(strchr(operand, ',') + 1) : 0;
+
+        // Each instruction takes a cycle, and a jump or a skip one more.
+        if (strchr(line, ':') && !strchr(line, ' '))
+        {
+            // A label.
+            continue;
+        }
+        cycles++;
+
+        if (strcmp(line, "CLRWDT") == 0)
+        {
+            mock_clrwdt();
+        }
+        else if (strcmp(line, "SLEEP") == 0)
+        {
+            mock_sleep();
+        }
+        else if ((strcmp(line, "NOP") == 0) ||
+                 (strncmp(line, "BANKSEL(", 8) == 0))
+        {
+            // GPIO and INTCON are both in bank 0, so BANKSEL is one BCF.
+        }
+        else if (strncmp(line, "BSF ", 4) == 0)
+        {
+            reg = mock_reg(AsmRegister(operand));
+            reg->byte |= (1 << bit);
+        }
+        else if (strncmp(line, "BCF ", 4) == 0)
+        {
+            reg = mock_reg(AsmRegister(operand));
+            reg->byte &= ~(1 << bit);
+        }
+        else if (strncmp(line, "BTFSS ", 6) == 0)
+        {
+            reg = mock_reg(AsmRegister(operand));
+            if ((reg->byte >> bit) & 1)
+            {
+                pc++;
+                cycles++;
+            }
+        }
+        else if (strncmp(line, "BTFSC ", 6) == 0)
+        {
+            reg = mock_reg(AsmRegister(operand));
+            if (!((reg->byte >> bit) & 1))
+            {
+                pc++;
+                cycles++;
+            }
+        }
+        else if (strncmp(line, "GOTO ", 5) == 0)
+        {
+            cycles++;
+            snprintf(label, sizeof(label), "%s:", operand);
+            for (target = 0; target < lineCount; target++)
+            {
+                if (strcmp(lines[target], label) == 0)
+                {
+                    break;
+                }
+            }
+            if (target == lineCount - 1)
+            {
+                break;
+            }
+            if (target == lineCount)
+            {
+                Fail("unknown assembly label", operand);
+            }
+            pc = target;
+        }
+        else
+        {
+            Fail("unsupported assembly instruction", line);
+        }
+    }
+
+    Sync();
+    lineCount = 0;
+    exitLabel[0] = 0;
+}
+
+/* =============================================================================
+ * The data EEPROM, erased (0xFF) at the start of each trace. A write takes no
+ * time, which is within a tick of the real ~5 ms.
+ * ===========================================================================*/
+unsigned char eeprom_read(unsigned char address)
+{
+    return eeprom[address & 0x7F];
+}
+
+void eeprom_write(unsigned char address, unsigned char value)
+{
+    eeprom[address & 0x7F] = value;
+}
+
+/* =============================================================================
+ * Adds an event to a trace.
+ * ===========================================================================*/
+static void AddEvent(trace_t *t, long ms, int kind, long value)
+{
+    int i;
+
+    if (t->eventCount == MAX_EVENTS)
+    {
+        Fail("too many events in", t->name);
+    }
+
+    // Keep the events in time order, after any at the same time.
+    for (i = t->eventCount; (i > 0) && (t->events[i - 1].time > (us_t)ms * 1000);
+         i--)
+    {
+        t->events[i] = t->events[i - 1];
+    }
+    t->events[i].time = (us_t)ms * 1000;
+    t->events[i].kind = kind;
+    t->events[i].value = value;
+    t->eventCount++;
+}
+
+/* =============================================================================
+ * Reads a trace file. Each line is one of, with times in ms:
+ *
+ *   press T D          switch 1 closed at T for D ms (press2 for switch 2)
+ *   low T / high T     switch 1 closed or open from T (low2, high2)
+ *   toggle T N L H     N presses from T, closed L ms then open H ms
+ *   brownout T D       Vdd below VBOR at T for D ms
+ *   upset T            PS_ON released and the power state cleared at T
+ *   end T              the end of the trace
+ *   expect on|off T    a PS_ON edge at T (expect2 for PS_ON2)
+ *
+ * An expect line with a variant suffix, e.g. expect.ioc0, is only for that
+ * variant, and replaces the plain expect lines for it. # starts a comment.
+ * ===========================================================================*/
+static void ReadTrace(trace_t *t, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[256];
+    char word[64];
+    char edge[8];
+    char *suffix;
+    long a;
+    long b;
+    long c;
+    long d;
+    int fields;
+    int channel;
+    int own;
+    int i;
+
+    if (!file)
+    {
+        Fail("can't open", path);
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->name = path;
+    while (fgets(line, sizeof(line), file))
+    {
+        if (strchr(line, '#'))
+        {
+            *strchr(line, '#') = 0;
+        }
+        fields = sscanf(line, "%63s", word);
+        if (fields < 1)
+        {
+            continue;
+        }
+
+        if (strncmp(word, "expect", 6) == 0)
+        {
+            channel = (word[6] == '2') ? 2 : 1;
+            suffix = strchr(word, '.');
+            if (suffix && (strcmp(suffix + 1, variant) != 0))
+            {
+                continue;
+            }
+            if (sscanf(line, "%*s %7s %ld", edge, &a) != 2)
+            {
+                Fail("bad expect line in", path);
+            }
+
+            // The first of the variant's own lines replaces the plain ones.
+            own = (suffix != NULL);
+            if (own && !t->variantExpected)
+            {
+                t->variantExpected = 1;
+                t->expectedCount = 0;
+                t->checkChannel2 = 0;
+            }
+            else if (!own && t->variantExpected)
+            {
+                continue;
+            }
+            if (t->expectedCount == MAX_EDGES)
+            {
+                Fail("too many expected edges in", path);
+            }
+            t->expected[t->expectedCount].channel = channel;
+            t->expected[t->expectedCount].on = (strcmp(edge, "on") == 0);
+            t->expected[t->expectedCount].time = (us_t)a * 1000;
+            t->expectedCount++;
+            t->checkChannel2 |= (channel == 2);
+        }
+        else if ((strcmp(word, "press") == 0) || (strcmp(word, "press2") == 0))
+        {
+            if (sscanf(line, "%*s %ld %ld", &a, &b) != 2)
+            {
+                Fail("bad press line in", path);
+            }
+            channel = word[5] ? EV_SWITCH2 : EV_SWITCH;
+            AddEvent(t, a, channel, 0);
+            AddEvent(t, a + b, channel, 1);
+        }
+        else if ((strncmp(word, "low", 3) == 0) ||
+                 (strncmp(word, "high", 4) == 0))
+        {
+            if (sscanf(line, "%*s %ld", &a) != 1)
+            {
+                Fail("bad low or high line in", path);
+            }
+            AddEvent(t, a, strchr(word, '2') ? EV_SWITCH2 : EV_SWITCH,
+                     word[0] == 'h');
+        }
+        else if (strcmp(word, "toggle") == 0)
+        {
+            if (sscanf(line, "%*s %ld %ld %ld %ld", &a, &b, &c, &d) != 4)
+            {
+                Fail("bad toggle line in", path);
+            }
+            for (i = 0; i < b; i++)
+            {
+                AddEvent(t, a + i * (c + d), EV_SWITCH, 0);
+                AddEvent(t, a + i * (c + d) + c, EV_SWITCH, 1);
+            }
+        }
+        else if (strcmp(word, "brownout") == 0)
+        {
+            if (sscanf(line, "%*s %ld %ld", &a, &b) != 2)
+            {
+                Fail("bad brownout line in", path);
+            }
+            AddEvent(t, a, EV_BROWNOUT, b);
+        }
+        else if (strcmp(word, "upset") == 0)
+        {
+            if (sscanf(line, "%*s %ld", &a) != 1)
+            {
+                Fail("bad upset line in", path);
+            }
+            AddEvent(t, a, EV_UPSET, 0);
+        }
+        else if (strcmp(word, "end") == 0)
+        {
+            if (sscanf(line, "%*s %ld", &a) != 1)
+            {
+                Fail("bad end line in", path);
+            }
+            t->end = (us_t)a * 1000;
+        }
+        else
+        {
+            Fail("unknown trace line", line);
+        }
+    }
+    fclose(file);
+
+    if (t->end == 0)
+    {
+        Fail("no end line in", path);
+    }
+}
+
+/* =============================================================================
+ * Returns the time switch 1 was last closed at or before a time, or the first
+ * time it was closed if first is set, in us. Returns 0 if it wasn't.
+ * ===========================================================================*/
+static us_t PressStart(us_t before, int first)
+{
+    us_t start = 0;
+    int level = 1;
+    int i;
+
+    for (i = 0; i < trace->eventCount; i++)
+    {
+        if ((trace->events[i].kind == EV_SWITCH) &&
+            (trace->events[i].time <= before))
+        {
+            if (level && !trace->events[i].value && (!first || !start))
+            {
+                start = trace->events[i].time;
+            }
+            level = (int)trace->events[i].value;
+        }
+    }
+    return start;
+}
+
+/* =============================================================================
+ * Estimates the average standby current, in uA, from the awake cycles over a
+ * time. This is the model above, not a measurement.
+ *
+ * param[in] awakeCycles The estimated cycles awake.
+ * param[in] seconds     The time they were spread over.
+ * ===========================================================================*/
+static double EstimateMicroamps(double awakeCycles, double seconds)
+{
+    return WDT_UA + BOR_UA + AWAKE_UA * (awakeCycles * 1e-6) / seconds;
+}
+
+/* =============================================================================
+ * Returns a total per wake, or 0 if there were none.
+ * ===========================================================================*/
+static double PerWake(unsigned long total, unsigned long count)
+{
+    return count ? (double)total / count : 0;
+}
+
+/* =============================================================================
+ * Formats a latency, which is - if there was none.
+ * ===========================================================================*/
+static const char *Latency(long ms, char *text)
+{
+    if (ms < 0)
+    {
+        return "-";
+    }
+    sprintf(text, "%ld", ms);
+    return text;
+}
+
+/* =============================================================================
+ * Runs one trace, checks its edges, and prints its results, and adds them to
+ * the CSV file if there is one.
+ *
+ * returns 1 if it passed.
+ * ===========================================================================*/
+static int RunTrace(trace_t *t, FILE *csv)
+{
+    char text[2][24];
+    int passed = 1;
+    int i;
+    int j;
+    us_t difference;
+    double wakeRate;
+    double microamps;
+
+    // Power the device up and run it to the end of the trace.
+    trace = t;
+    nextEvent = 0;
+    now = 0;
+    switch1 = 1;
+    switch2 = 1;
+    latch = 0;
+    presented = 0;
+    powered[1] = 0;
+    powered[2] = 0;
+    edgeCount = 0;
+    accesses = 0;
+    blocks = 0;
+    cycles = 0;
+    windowCycles = 0;
+    windowStart = 0;
+    windowBlocks = 0;
+    wakes = 0;
+    memset(&idle, 0, sizeof(idle));
+    memset(&held, 0, sizeof(held));
+    maxAccesses = 0;
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    if (!setjmp(endJump))
+    {
+        if (!setjmp(resetJump))
+        {
+            Reset(RESET_POR, 0);
+        }
+        fw_main();
+        Fail("firmware returned from main in", t->name);
+    }
+
+    // Check the edges against the expected ones, in order.
+    for (i = 0, j = 0; (i < edgeCount) || (j < t->expectedCount); i++, j++)
+    {
+        if ((i == edgeCount) || (j == t->expectedCount))
+        {
+            passed = 0;
+            break;
+        }
+        difference = (edges[i].time > t->expected[j].time) ?
+                     edges[i].time - t->expected[j].time :
+                     t->expected[j].time - edges[i].time;
+        if ((edges[i].channel != t->expected[j].channel) ||
+            (edges[i].on != t->expected[j].on) || (difference > tolerance))
+        {
+            passed = 0;
+            break;
+        }
+    }
+
+    // The latencies of the first on and off edges of PS_ON: on from the first
+    // press, which may bounce, and off from the press it happened in.
+    onLatency = -1;
+    offLatency = -1;
+    for (i = edgeCount - 1; i >= 0; i--)
+    {
+        if ((edges[i].channel == 1) && edges[i].on &&
+            PressStart(edges[i].time, 1))
+        {
+            onLatency = (long)((edges[i].time - PressStart(edges[i].time, 1)) /
+                               1000);
+        }
+        else if ((edges[i].channel == 1) && !edges[i].on &&
+                 PressStart(edges[i].time, 0))
+        {
+            offLatency = (long)((edges[i].time - PressStart(edges[i].time, 0)) /
+                                1000);
+        }
+    }
+
+    wakeRate = wakes / ((double)t->end / 1e6);
+    microamps = EstimateMicroamps((double)(idle.cycles + held.cycles),
+                                  (double)t->end / 1e6);
+
+    printf("%-4s %-10s %s\n", passed ? "PASS" : "FAIL", variant, t->name);
+    printf("     wakes %lu (%.2f/s), per wake idle %.1f accesses %.1f blocks,"
+           " held %.1f accesses %.1f blocks, max %lu accesses\n     ", wakes,
+           wakeRate, PerWake(idle.accesses, idle.count),
+           PerWake(idle.blocks, idle.count), PerWake(held.accesses, held.count),
+           PerWake(held.blocks, held.count), maxAccesses);
+    printf("on after %s ms, off after %s ms, estimated ~%.0f cycles per idle"
+           " wake, ~%.2f uA, ~%.3f mAh/day\n", Latency(onLatency, text[0]),
+           Latency(offLatency, text[1]), PerWake(idle.cycles, idle.count),
+           microamps, microamps * 0.024);
+
+    if (!passed)
+    {
+        printf("     PS_ON edges (ms):");
+        for (i = 0; i < edgeCount; i++)
+        {
+            printf(" %s%s@%llu", (edges[i].channel == 2) ? "2:" : "",
+                   edges[i].on ? "on" : "off", edges[i].time / 1000);
+        }
+        printf("\n     expected:");
+        for (j = 0; j < t->expectedCount; j++)
+        {
+            printf(" %s%s@%llu", (t->expected[j].channel == 2) ? "2:" : "",
+                   t->expected[j].on ? "on" : "off", t->expected[j].time / 1000);
+        }
+        printf("\n");
+    }
+
+    if (csv)
+    {
+        fprintf(csv, "%s,%s,%s,%.0f,%lu,%.3f,%.1f,%.1f,%.1f,%.1f,%lu,", variant,
+                strrchr(t->name, '/') ? strrchr(t->name, '/') + 1 : t->name,
+                passed ? "pass" : "fail", (double)t->end / 1e6, wakes,
+                wakeRate, PerWake(idle.accesses, idle.count),
+                PerWake(idle.blocks, idle.count),
+                PerWake(held.accesses, held.count),
+                PerWake(held.blocks, held.count), maxAccesses);
+        fprintf(csv, "%s,", (onLatency < 0) ? "" : Latency(onLatency, text[0]));
+        fprintf(csv, "%s,", (offLatency < 0) ? "" : Latency(offLatency, text[1]));
+        fprintf(csv, "%.0f,%.3f,%.3f,%.3f\n", PerWake(idle.cycles, idle.count),
+                microamps - WDT_UA - BOR_UA, microamps, microamps * 0.024);
+    }
+    return passed;
+}
+
+/* =============================================================================
+ * Main entry point.
+ * ===========================================================================*/
+int main(int argc, char *argv[])
+{
+    static trace_t t;
+    FILE *csv = NULL;
+    int failed = 0;
+    int i;
+
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i += 2)
+    {
+        if (i + 1 == argc)
+        {
+            Fail("missing value for", argv[i]);
+        }
+        switch (argv[i][1])
+        {
+        case 'v': variant = argv[i + 1]; break;
+        case 't': tolerance = strtoull(argv[i + 1], NULL, 0) * 1000; break;
+        case 'w': wdtBase = strtoull(argv[i + 1], NULL, 0) * 1000; break;
+        case 'p': powerUpTimer = strtoull(argv[i + 1], NULL, 0) * 1000; break;
+        case 'c':
+            csv = fopen(argv[i + 1], "a");
+            if (!csv)
+            {
+                Fail("can't open", argv[i + 1]);
+            }
+            fseek(csv, 0, SEEK_END);
+            if (ftell(csv) == 0)
+            {
+                fprintf(csv, "%s\n", CSV_HEADER);
+            }
+            break;
+        default: Fail("unknown option", argv[i]);
+        }
+    }
+    if (i == argc)
+    {
+        Fail("usage: harness [-v variant] [-t tolerance_ms] [-w wdt_ms] "
+             "[-p pwrt_ms] [-c results.csv] trace...", NULL);
+    }
+
+    // Keep the firmware's RAM as the C startup leaves it, to reload it on each
+    // reset.
+    if (SECTION_SIZE(fw_bss))
+    {
+        bssImage = malloc(SECTION_SIZE(fw_bss));
+        memcpy(bssImage, __start_fw_bss, SECTION_SIZE(fw_bss));
+    }
+    if (SECTION_SIZE(fw_data))
+    {
+        dataImage = malloc(SECTION_SIZE(fw_data));
+        memcpy(dataImage, __start_fw_data, SECTION_SIZE(fw_data));
+    }
+
+    for (; i < argc; i++)
+    {
+        ReadTrace(&t, argv[i]);
+        if (!RunTrace(&t, csv))
+        {
+            failed++;
+        }
+    }
+
+    if (csv)
+    {
+        fclose(csv);
+    }
+    return failed ? 1 : 0;
+}
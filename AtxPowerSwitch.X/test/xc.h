@@ -0,0 +1,124 @@
+/* =============================================================================
+ * Host stand-in for XC8's <xc.h>, for building AtxPowerSwitch.c with gcc in
+ * the trace harness (see harness.c).
+ *
+ * Every special function register the firmware uses on the PIC12F675 is a
+ * macro that goes through mock_reg(), which counts the access, so that the
+ * harness can measure the awake window as register accesses per wake. The bit
+ * names are views of the same byte, as in the real header. CLRWDT(), SLEEP()
+ * and _delay() call back into the harness, which moves simulated time on and
+ * drives GP4 from the trace.
+ *
+ * Only the registers of the part are here. Timer1, the comparator and the ADC
+ * are plain storage, so firmware using them builds but can't be run.
+ * ===========================================================================*/
+#ifndef MOCK_XC_H
+#define MOCK_XC_H
+
+#define _12F675 1
+
+// Persistent variables go in their own section, which the harness keeps
+// across a brown-out reset while the rest of the firmware's RAM is cleared.
+#define persistent __attribute__((section("fw_keep")))
+
+// The registers, by index into the harness's register file.
+enum
+{
+    MOCK_GPIO,
+    MOCK_TRISIO,
+    MOCK_WPU,
+    MOCK_IOC,
+    MOCK_INTCON,
+    MOCK_OPTION_REG,
+    MOCK_PCON,
+    MOCK_STATUS,
+    MOCK_ANSEL,
+    MOCK_CMCON,
+    MOCK_VRCON,
+    MOCK_OSCCAL,
+    MOCK_T1CON,
+    MOCK_TMR1H,
+    MOCK_TMR1L,
+    MOCK_PIR1,
+    MOCK_PIE1,
+    MOCK_ADCON0,
+    MOCK_ADRESH,
+    MOCK_REGS
+};
+
+// One register, with every bit name the firmware uses on it.
+typedef union
+{
+    unsigned char byte;
+    struct { unsigned b0:1, b1:1, b2:1, b3:1, b4:1, b5:1, b6:1, b7:1; } bit;
+    struct { unsigned GPIO0:1, GPIO1:1, GPIO2:1, GPIO3:1, GPIO4:1, GPIO5:1; }
+        gpio;
+    struct { unsigned WPU0:1, WPU1:1, WPU2:1, WPU3:1, WPU4:1, WPU5:1; } wpu;
+    struct { unsigned IOC0:1, IOC1:1, IOC2:1, IOC3:1, IOC4:1, IOC5:1; } ioc;
+    struct { unsigned GPIF:1, INTF:1, T0IF:1, GPIE:1, INTE:1, T0IE:1, PEIE:1,
+             GIE:1; } intcon;
+    struct { unsigned nBOD:1, nPOR:1; } pcon;
+    struct { unsigned C:1, DC:1, Z:1, nPD:1, nTO:1, RP0:1, RP1:1, IRP:1; }
+        status;
+    struct { unsigned ANS0:1, ANS1:1, ANS2:1, ANS3:1; } ansel;
+    struct { unsigned CM:3, CIS:1, CINV:1, :1, COUT:1; } cmcon;
+    struct { unsigned TMR1ON:1; } t1con;
+    struct { unsigned TMR1IF:1, :2, CMIF:1; } pir1;
+    struct { unsigned TMR1IE:1, :2, CMIE:1; } pie1;
+    struct { unsigned ADON:1, GO_nDONE:1; } adcon0;
+} mock_reg_t;
+
+mock_reg_t *mock_reg(int reg);
+
+#define GPIO                (mock_reg(MOCK_GPIO)->byte)
+#define GPIObits            (mock_reg(MOCK_GPIO)->gpio)
+#define TRISIO              (mock_reg(MOCK_TRISIO)->byte)
+#define TRISIO0             (mock_reg(MOCK_TRISIO)->bit.b0)
+#define TRISIO1             (mock_reg(MOCK_TRISIO)->bit.b1)
+#define TRISIO2             (mock_reg(MOCK_TRISIO)->bit.b2)
+#define TRISIO3             (mock_reg(MOCK_TRISIO)->bit.b3)
+#define TRISIO4             (mock_reg(MOCK_TRISIO)->bit.b4)
+#define TRISIO5             (mock_reg(MOCK_TRISIO)->bit.b5)
+#define WPU                 (mock_reg(MOCK_WPU)->byte)
+#define WPUbits             (mock_reg(MOCK_WPU)->wpu)
+#define IOC                 (mock_reg(MOCK_IOC)->byte)
+#define IOCbits             (mock_reg(MOCK_IOC)->ioc)
+#define INTCON              (mock_reg(MOCK_INTCON)->byte)
+#define INTCONbits          (mock_reg(MOCK_INTCON)->intcon)
+#define OPTION_REG          (mock_reg(MOCK_OPTION_REG)->byte)
+#define PCON                (mock_reg(MOCK_PCON)->byte)
+#define PCONbits            (mock_reg(MOCK_PCON)->pcon)
+#define STATUSbits          (mock_reg(MOCK_STATUS)->status)
+#define ANSEL               (mock_reg(MOCK_ANSEL)->byte)
+#define ANSELbits           (mock_reg(MOCK_ANSEL)->ansel)
+#define CMCON               (mock_reg(MOCK_CMCON)->byte)
+#define CMCONbits           (mock_reg(MOCK_CMCON)->cmcon)
+#define VRCON               (mock_reg(MOCK_VRCON)->byte)
+#define OSCCAL              (mock_reg(MOCK_OSCCAL)->byte)
+#define T1CON               (mock_reg(MOCK_T1CON)->byte)
+#define T1CONbits           (mock_reg(MOCK_T1CON)->t1con)
+#define TMR1H               (mock_reg(MOCK_TMR1H)->byte)
+#define TMR1L               (mock_reg(MOCK_TMR1L)->byte)
+#define PIR1bits            (mock_reg(MOCK_PIR1)->pir1)
+#define PIE1bits            (mock_reg(MOCK_PIE1)->pie1)
+#define ADCON0              (mock_reg(MOCK_ADCON0)->byte)
+#define ADCON0bits          (mock_reg(MOCK_ADCON0)->adcon0)
+#define ADRESH              (mock_reg(MOCK_ADRESH)->byte)
+
+// The instructions and library calls, as harness hooks. The assembly idle loop
+// (USE_ASM_IDLE) is collected line by line and run by a small interpreter.
+void mock_clrwdt(void);
+void mock_sleep(void);
+void mock_delay(unsigned long cycles);
+void mock_asm(const char *line);
+unsigned char eeprom_read(unsigned char address);
+void eeprom_write(unsigned char address, unsigned char value);
+
+#define CLRWDT()            mock_clrwdt()
+#define SLEEP()             mock_sleep()
+#define NOP()               ((void)0)
+#define _delay(n)           mock_delay(n)
+#define asm(line)           mock_asm(line)
+#define __osccal_val()      (0x80)
+
+#endif